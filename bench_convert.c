@@ -0,0 +1,117 @@
+/*
+ * bench_convert - check and time the sample format conversions
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * bench_convert [-n samples] [-i iterations]
+ *
+ * For every CPU level this machine supports and every stored format, a block
+ * of samples (a sweep across full scale and beyond, with odd lengths so the
+ * scalar tails run) is converted and back, and the results compared with
+ * the scalar kernels.  Times are nanoseconds per block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "interleave.h"
+#include "convert.h"
+#include "format.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/* Do k and the scalar kernel agree on the first n samples of src? */
+static int
+check(const struct convert_kernel *k, const struct convert_kernel *s,
+	const float *src, size_t n, char *a, char *b, float *fa, float *fb)
+{
+	k->encode(a, src, n, NULL);
+	s->encode(b, src, n, NULL);
+	if (memcmp(a, b, n * k->size) != 0)
+		return (-1);
+	k->decode(fa, a, n);
+	s->decode(fb, a, n);
+	return (memcmp(fa, fb, n * sizeof(float)) == 0 ? 0 : -1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static int formats[] = { FORMAT_INT16, FORMAT_INT24, FORMAT_FLOAT16 };
+	const struct convert_kernel *k, *s;
+	uint32_t seed[DITHER_LANES];
+	size_t nsamples = 8192, n;
+	int iterations = 20000;
+	int level, i, j, opt, bad;
+	float *src, *fa, *fb;
+	char *a, *b;
+	double start, enc, dith, dec;
+
+	while ((opt = getopt(argc, argv, "n:i:")) != -1) {
+		switch(opt) {
+		case 'n':	nsamples = atoi(optarg);	break;
+		case 'i':	iterations = atoi(optarg);	break;
+		default:
+			fprintf(stderr, "bench_convert [-n samples] [-i iterations]\n");
+			exit(1);
+		}
+	}
+
+	src = malloc(nsamples * sizeof(float));
+	fa = malloc(nsamples * sizeof(float));
+	fb = malloc(nsamples * sizeof(float));
+	a = malloc(nsamples * sizeof(float) + 64);
+	b = malloc(nsamples * sizeof(float) + 64);
+	for (n=0; n < nsamples; n++)
+		src[n] = -1.25f + 2.5f * n / nsamples;
+	dither_init(seed);
+
+	interleave_init();
+	printf("%zu samples, %d iterations, cpu level %s\n", nsamples,
+		iterations, interleave_level_name(interleave_level()));
+	printf("%-7s %-10s %10s %10s %10s %6s\n", "level", "kernel",
+		"encode ns", "dither ns", "decode ns", "check");
+
+	for (level=IL_SCALAR; level <= interleave_level(); level++) {
+		for (i=0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+			k = convert_lookup(level, formats[i]);
+			s = convert_lookup(IL_SCALAR, formats[i]);
+			bad = 0;
+			for (j=0; j < 40; j++) {
+				n = nsamples - j * 7;
+				if (check(k, s, src, n, a, b, fa, fb) == -1)
+					bad++;
+			}
+
+			start = now();
+			for (j=0; j < iterations; j++)
+				k->encode(a, src, nsamples, NULL);
+			enc = (now() - start) / iterations;
+			start = now();
+			for (j=0; j < iterations; j++)
+				k->encode(a, src, nsamples, seed);
+			dith = (now() - start) / iterations;
+			start = now();
+			for (j=0; j < iterations; j++)
+				k->decode(fa, a, nsamples);
+			dec = (now() - start) / iterations;
+			printf("%-7s %-10s %10.0f %10.0f %10.0f %6s\n",
+				interleave_level_name(level), k->name, enc,
+				dith, dec, bad ? "FAIL" : "ok");
+		}
+	}
+	return (0);
+}
@@ -0,0 +1,157 @@
+/*
+ * bench_interleave - check and time the interleave kernels
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * bench_interleave [-f frames] [-i iterations]
+ *
+ * For every CPU level this machine supports, and a range of port counts, one
+ * jack period is interleaved and de-interleaved repeatedly by the kernel
+ * interleave_select would choose and by the generic kernel of that level.
+ * Both are first compared with the scalar kernel, over odd lengths and
+ * starting frames so the scalar tails run, and both ways round.  Times are
+ * nanoseconds per period.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "interleave.h"
+
+#define MAX_PORTS	32
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/*
+ * Do k and the scalar kernel s agree on frames [first, first+nframes) of
+ * nports ports?  Interleaving goes to a and b; de-interleaving a goes to
+ * out, which must then hold the ports again.
+ */
+static int
+check(const struct interleave_kernel *k, const struct interleave_kernel *s,
+	float **ports, float **out, float *a, float *b, int nports,
+	size_t first, size_t nframes)
+{
+	int i;
+
+	k->interleave(a, ports, nports, first, nframes);
+	s->interleave(b, ports, nports, first, nframes);
+	if (memcmp(a, b, nports * nframes * sizeof(float)) != 0)
+		return (-1);
+	k->deinterleave(out, a, nports, first, nframes);
+	for (i=0; i < nports; i++) {
+		if (memcmp(out[i] + first, ports[i] + first,
+		    nframes * sizeof(float)) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/* ns per call of kernel k (interleave if dir is 0, else de-interleave) */
+static double
+run(const struct interleave_kernel *k, int dir, float **ports, float *frames,
+	int nports, size_t nframes, int iterations)
+{
+	double start;
+	int i;
+
+	start = now();
+	for (i=0; i < iterations; i++) {
+		if (dir == 0)
+			k->interleave(frames, ports, nports, 0, nframes);
+		else
+			k->deinterleave(ports, frames, nports, 0, nframes);
+	}
+	return ((now() - start) / iterations);
+}
+
+int
+main(int argc, char **argv)
+{
+	static int counts[] = { 1, 2, 3, 4, 6, 8, 12, 16, 32 };
+	const struct interleave_kernel *k, *g, *s;
+	float *ports[MAX_PORTS], *out[MAX_PORTS];
+	float *frames, *b;
+	size_t nframes = 1024, first, len;
+	int iterations = 20000;
+	int level, n, i, j, opt, bad;
+	double ki, kd, gi, gd;
+
+	while ((opt = getopt(argc, argv, "f:i:")) != -1) {
+		switch(opt) {
+		case 'f':	nframes = atoi(optarg);		break;
+		case 'i':	iterations = atoi(optarg);	break;
+		default:
+			fprintf(stderr, "bench_interleave [-f frames] [-i iterations]\n");
+			exit(1);
+		}
+	}
+
+	for (i=0; i < MAX_PORTS; i++) {
+		if (posix_memalign((void **)&ports[i], 64,
+		    nframes * sizeof(float)) != 0 ||
+		    posix_memalign((void **)&out[i], 64,
+		    nframes * sizeof(float)) != 0) {
+			perror("posix_memalign");
+			exit(1);
+		}
+		for (n=0; n < nframes; n++)
+			ports[i][n] = i * nframes + n;
+	}
+	if (posix_memalign((void **)&frames, 64,
+	    MAX_PORTS * nframes * sizeof(float)) != 0 ||
+	    posix_memalign((void **)&b, 64,
+	    MAX_PORTS * nframes * sizeof(float)) != 0) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(frames, 0, MAX_PORTS * nframes * sizeof(float));
+
+	interleave_init();
+	printf("%zu frames per period, %d iterations, cpu level %s\n",
+		nframes, iterations, interleave_level_name(interleave_level()));
+	printf("%-7s %5s  %-10s %10s %10s  %-10s %10s %10s %7s %6s\n",
+		"level", "ports", "selected", "inter ns", "de ns",
+		"generic", "inter ns", "de ns", "gain", "check");
+
+	for (level=IL_SCALAR; level <= interleave_level(); level++) {
+		for (i=0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+			n = counts[i];
+			k = interleave_lookup(level, n);
+			g = interleave_generic(level);
+			s = interleave_lookup(IL_SCALAR, n);
+			bad = 0;
+			for (j=0; j < 20 && j * 7 < nframes; j++) {
+				first = j;
+				len = nframes - j * 7;
+				if (check(k, s, ports, out, frames, b, n,
+				    first, len) == -1 ||
+				    check(g, s, ports, out, frames, b, n,
+				    first, len) == -1)
+					bad++;
+			}
+			ki = run(k, 0, ports, frames, n, nframes, iterations);
+			kd = run(k, 1, ports, frames, n, nframes, iterations);
+			gi = run(g, 0, ports, frames, n, nframes, iterations);
+			gd = run(g, 1, ports, frames, n, nframes, iterations);
+			printf("%-7s %5d  %-10s %10.0f %10.0f  %-10s %10.0f %10.0f %6.2fx %6s\n",
+				interleave_level_name(level), n,
+				k->name, ki, kd, g->name, gi, gd,
+				(gi + gd) / (ki + kd), bad ? "FAIL" : "ok");
+		}
+	}
+	return (0);
+}
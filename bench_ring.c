@@ -0,0 +1,269 @@
+/*
+ * bench_ring - compare the ring buffer with the jack ringbuffer
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * bench_ring [-s ring size] [-b block] [-m megabytes]
+ *
+ * A producer thread puts jack periods of frames into each ring, as the
+ * capture callback does, and a consumer thread takes blocks out, as the
+ * disk thread does, for a range of port counts and period sizes.  Every
+ * sample carries a sequence number, which the consumer checks.  Times are
+ * nanoseconds per period and the total throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <jack/ringbuffer.h>
+#include "ring.h"
+
+/* Space or data: two parts for the jack ringbuffer when it wraps */
+struct span {
+	char *buf;
+	size_t len;
+};
+
+/* The two rings, behind the same operations */
+struct ops {
+	const char *name;
+	void *(*create)(size_t size);
+	void (*destroy)(void *r);
+	size_t (*reserve)(void *r, size_t want, struct span *vec);
+	void (*commit)(void *r, size_t len);
+	size_t (*peek)(void *r, size_t want, struct span *vec);
+	void (*consume)(void *r, size_t len);
+};
+
+static void *
+ring_create_op(size_t size)
+{
+	return (ring_create(size));
+}
+
+static void
+ring_destroy_op(void *r)
+{
+	ring_free(r);
+}
+
+static size_t
+ring_reserve_op(void *r, size_t want, struct span *vec)
+{
+	vec[0].len = ring_reserve(r, want, &vec[0].buf);
+	vec[1].len = 0;
+	return (vec[0].len);
+}
+
+static void
+ring_commit_op(void *r, size_t len)
+{
+	ring_commit(r, len);
+}
+
+static size_t
+ring_peek_op(void *r, size_t want, struct span *vec)
+{
+	vec[0].len = ring_peek(r, want, &vec[0].buf);
+	vec[1].len = 0;
+	return (vec[0].len);
+}
+
+static void
+ring_consume_op(void *r, size_t len)
+{
+	ring_consume(r, len);
+}
+
+static void *
+jack_create_op(size_t size)
+{
+	return (jack_ringbuffer_create(size));
+}
+
+static void
+jack_destroy_op(void *r)
+{
+	jack_ringbuffer_free(r);
+}
+
+/* jack_ringbuffer_data_t is laid out as struct span */
+static size_t
+jack_reserve_op(void *r, size_t want, struct span *vec)
+{
+	jack_ringbuffer_get_write_vector(r, (jack_ringbuffer_data_t *)vec);
+	return (vec[0].len + vec[1].len);
+}
+
+static void
+jack_commit_op(void *r, size_t len)
+{
+	jack_ringbuffer_write_advance(r, len);
+}
+
+static size_t
+jack_peek_op(void *r, size_t want, struct span *vec)
+{
+	jack_ringbuffer_get_read_vector(r, (jack_ringbuffer_data_t *)vec);
+	return (vec[0].len + vec[1].len);
+}
+
+static void
+jack_consume_op(void *r, size_t len)
+{
+	jack_ringbuffer_read_advance(r, len);
+}
+
+static const struct ops rings[] = {
+	{ "ring", ring_create_op, ring_destroy_op, ring_reserve_op,
+	  ring_commit_op, ring_peek_op, ring_consume_op },
+	{ "jack", jack_create_op, jack_destroy_op, jack_reserve_op,
+	  jack_commit_op, jack_peek_op, jack_consume_op },
+};
+
+struct run {
+	const struct ops *o;
+	void *r;
+	size_t period;		/* bytes the producer puts in at a time */
+	size_t block;		/* most the consumer takes at a time */
+	size_t total;		/* bytes to pass through */
+	long bad;		/* samples out of sequence */
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/* Number samples seq on, into len bytes of vec */
+static uint32_t
+fill(struct span *vec, size_t len, uint32_t seq)
+{
+	uint32_t *p;
+	size_t n;
+	int i;
+
+	for (i=0; i < 2 && len > 0; i++) {
+		n = vec[i].len < len ? vec[i].len : len;
+		len -= n;
+		for (p = (uint32_t *)vec[i].buf; n > 0; n -= sizeof(*p))
+			*p++ = seq++;
+	}
+	return (seq);
+}
+
+static void *
+producer(void *arg)
+{
+	struct run *run = arg;
+	struct span vec[2];
+	uint32_t seq = 0;
+	size_t done;
+
+	for (done = 0; done < run->total; done += run->period) {
+		while (run->o->reserve(run->r, run->period, vec) < run->period)
+			sched_yield();
+		seq = fill(vec, run->period, seq);
+		run->o->commit(run->r, run->period);
+	}
+	return (NULL);
+}
+
+static void *
+consumer(void *arg)
+{
+	struct run *run = arg;
+	struct span vec[2];
+	uint32_t seq = 0, *p;
+	size_t done, len, n;
+	int i;
+
+	for (done = 0; done < run->total; done += len) {
+		while ((len = run->o->peek(run->r, run->block, vec)) == 0)
+			sched_yield();
+		if (len > run->block)
+			len = run->block;
+		for (i=0, n = len; i < 2 && n > 0; i++) {
+			size_t l = vec[i].len < n ? vec[i].len : n;
+
+			n -= l;
+			for (p = (uint32_t *)vec[i].buf; l > 0; l -= sizeof(*p))
+				if (*p++ != seq++)
+					run->bad++;
+		}
+		run->o->consume(run->r, len);
+	}
+	return (NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	static int ports[] = { 1, 2, 8, 24, 32 };
+	static int frames[] = { 64, 256, 1024 };
+	struct run run;
+	pthread_t pt, ct;
+	size_t size = 1048576, block = 1048576, mb = 512;
+	double start, t;
+	int opt, i, j, k;
+
+	while ((opt = getopt(argc, argv, "s:b:m:")) != -1) {
+		switch(opt) {
+		case 's':	size = atol(optarg);	break;
+		case 'b':	block = atol(optarg);	break;
+		case 'm':	mb = atol(optarg);	break;
+		default:
+			fprintf(stderr,
+				"bench_ring [-s ring size] [-b block] [-m megabytes]\n");
+			exit(1);
+		}
+	}
+
+	printf("%zu byte ring, %zu byte blocks, %zu MB\n", size, block, mb);
+	printf("%-5s %6s %7s %10s %10s %6s\n", "ring", "ports", "frames",
+		"ns/period", "MB/s", "check");
+	for (i=0; i < sizeof(ports) / sizeof(ports[0]); i++) {
+		for (j=0; j < sizeof(frames) / sizeof(frames[0]); j++) {
+			for (k=0; k < sizeof(rings) / sizeof(rings[0]); k++) {
+				memset(&run, 0, sizeof(run));
+				run.o = &rings[k];
+				run.period = ports[i] * frames[j] * sizeof(float);
+				run.block = block;
+				run.total = mb * 1048576 / run.period * run.period;
+				run.r = run.o->create(size);
+				if (run.r == NULL || run.period > size / 2) {
+					fprintf(stderr, "ring too small\n");
+					exit(1);
+				}
+
+				start = now();
+				pthread_create(&ct, NULL, consumer, &run);
+				pthread_create(&pt, NULL, producer, &run);
+				pthread_join(pt, NULL);
+				pthread_join(ct, NULL);
+				t = now() - start;
+
+				printf("%-5s %6d %7d %10.0f %10.0f %6s\n",
+					run.o->name, ports[i], frames[j],
+					t / (run.total / run.period),
+					run.total / t * 1e9 / 1048576,
+					run.bad ? "FAIL" : "ok");
+				run.o->destroy(run.r);
+			}
+		}
+	}
+	return (0);
+}
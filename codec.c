@@ -0,0 +1,147 @@
+/*
+ * codec - lossless compression of interleaved float frames
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * A predictive XOR coder in the style of FPC and Gorilla.  Each sample is
+ * predicted from the earlier samples of its own channel, two ways: the last
+ * sample, and a linear extrapolation of the last two (on the bit patterns,
+ * which for floats of the same sign and exponent is close to extrapolating
+ * the values).  The sample is XORed with whichever prediction leaves more
+ * leading zero bytes, and only the bytes after those are stored.
+ *
+ * Samples are coded in pairs: one byte holding a 4 bit code for each (bit 3
+ * the predictor, bits 0-2 the count of bytes stored, 0 to 4), then the
+ * stored bytes of the first and of the second, low byte first.  Silence and
+ * slowly changing signals need a few bits per sample; noise costs at most
+ * 4.5 bytes, and the caller stores such chunks uncompressed.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "codec.h"
+
+/* Largest encoding of len bytes of samples */
+size_t
+codec_bound(size_t len)
+{
+	size_t n = len / sizeof(float);
+
+	return ((n + 1) / 2 + n * sizeof(float));
+}
+
+/* Bytes needed for x once its leading zero bytes are dropped */
+static inline int
+sigbytes(uint32_t x)
+{
+	return (x == 0 ? 0 : 4 - __builtin_clz(x) / 8);
+}
+
+/* XOR v with the better prediction; returns its 4 bit code */
+static inline int
+predict(uint32_t v, uint32_t last, uint32_t last2, uint32_t *x)
+{
+	uint32_t x1 = v ^ last;
+	uint32_t x2 = v ^ (2 * last - last2);
+	int n1 = sigbytes(x1), n2 = sigbytes(x2);
+
+	if (n2 < n1) {
+		*x = x2;
+		return (8 | n2);
+	}
+	*x = x1;
+	return (n1);
+}
+
+static inline char *
+put(char *p, uint32_t x, int n)
+{
+	int i;
+
+	for (i=0; i < n; i++)
+		*p++ = x >> (8 * i);
+	return (p);
+}
+
+/*
+ * Encode frames interleaved frames of nports samples from src into dst,
+ * which has room for codec_bound bytes.  Returns the encoded length.
+ */
+size_t
+codec_encode(char *dst, const float *src, size_t frames, int nports)
+{
+	uint32_t last[CODEC_MAX_CHANNELS], last2[CODEC_MAX_CHANNELS];
+	uint32_t v[2], x[2];
+	size_t i, n = frames * nports;
+	int ch = 0, k, code[2];
+	char *p = dst, *ctl;
+
+	memset(last, 0, nports * sizeof(uint32_t));
+	memset(last2, 0, nports * sizeof(uint32_t));
+	for (i=0; i < n; i += 2) {
+		for (k=0; k < 2; k++) {
+			if (i + k == n) {
+				code[k] = 0;
+				x[k] = 0;
+				break;
+			}
+			memcpy(&v[k], &src[i + k], sizeof(uint32_t));
+			code[k] = predict(v[k], last[ch], last2[ch], &x[k]);
+			last2[ch] = last[ch];
+			last[ch] = v[k];
+			if (++ch == nports)
+				ch = 0;
+		}
+		ctl = p++;
+		*ctl = code[0] | code[1] << 4;
+		p = put(p, x[0], code[0] & 7);
+		p = put(p, x[1], code[1] & 7);
+	}
+	return (p - dst);
+}
+
+/*
+ * Decode len bytes from src into frames frames of nports samples.  Returns
+ * -1 if src is not a valid encoding of that many samples.
+ */
+int
+codec_decode(float *dst, const char *src, size_t len, size_t frames,
+	int nports)
+{
+	uint32_t last[CODEC_MAX_CHANNELS], last2[CODEC_MAX_CHANNELS];
+	const unsigned char *p = (const unsigned char *)src;
+	const unsigned char *end = p + len;
+	size_t i, n = frames * nports;
+	uint32_t x, v;
+	int ch = 0, k, b, code, ctl;
+
+	memset(last, 0, nports * sizeof(uint32_t));
+	memset(last2, 0, nports * sizeof(uint32_t));
+	for (i=0; i < n; i += 2) {
+		if (p == end)
+			return (-1);
+		ctl = *p++;
+		for (k=0; k < 2 && i + k < n; k++) {
+			code = (ctl >> (4 * k)) & 15;
+			if ((code & 7) > 4 || p + (code & 7) > end)
+				return (-1);
+			x = 0;
+			for (b=0; b < (code & 7); b++)
+				x |= (uint32_t)*p++ << (8 * b);
+			if (code & 8)
+				v = x ^ (2 * last[ch] - last2[ch]);
+			else
+				v = x ^ last[ch];
+			memcpy(&dst[i + k], &v, sizeof(uint32_t));
+			last2[ch] = last[ch];
+			last[ch] = v;
+			if (++ch == nports)
+				ch = 0;
+		}
+	}
+	return (p == end ? 0 : -1);
+}
@@ -0,0 +1,22 @@
+/*
+ * codec - lossless compression of interleaved float frames
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+#define CODEC_MAX_CHANNELS	256
+
+size_t codec_bound(size_t len);
+size_t codec_encode(char *dst, const float *src, size_t frames, int nports);
+int codec_decode(float *dst, const char *src, size_t len, size_t frames,
+	int nports);
+
+#endif /* CODEC_H */
@@ -0,0 +1,492 @@
+/*
+ * convert - store samples in reduced precision formats
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * JACK samples are 32 bit floats, nominally in [-1, 1).  A file can store
+ * them as 16 bit or packed 24 bit little-endian integers (scaled by 2^15 or
+ * 2^23, rounded to nearest and clipped) or as IEEE half precision floats.
+ * The disk thread converts whole blocks, never the jack callback.
+ *
+ * int16 can be dithered: triangular (TPDF) noise of +-1 LSB, the difference
+ * of two uniform random numbers (the two halves of a xorshift generator's
+ * output), is added before rounding, so the rounding error is noise rather
+ * than distortion of quiet signals.
+ *
+ * As in interleave.c there are kernels for each CPU level; the SIMD ones
+ * do whole vectors and leave the rest to the scalar ones.  SSE2 has no byte
+ * shuffle, so packed 24 bit samples are scalar below AVX2, and half floats
+ * need F16C.  AVX-512 machines use the AVX2 kernels: the conversions are
+ * limited by memory, not by vector width.
+ */
+
+#include <string.h>
+#include <math.h>
+#include "convert.h"
+#include "format.h"
+#include "interleave.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD	1
+#endif
+
+#define S16_SCALE	32768.0f
+#define S24_SCALE	8388608.0f
+
+static inline uint32_t
+xorshift(uint32_t x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (x);
+}
+
+/* TPDF dither, in LSBs, from seed */
+static inline float
+tpdf(uint32_t *seed)
+{
+	uint32_t x = *seed = xorshift(*seed);
+
+	return (((float)(x >> 16) - (float)(x & 0xffff)) * (1.0f / 65536.0f));
+}
+
+void
+dither_init(uint32_t *seed)
+{
+	int i;
+
+	for (i=0; i < DITHER_LANES; i++)
+		seed[i] = 0x9e3779b9u * (i + 1);
+}
+
+/*
+ * Scale, clip and round x.  NaN clips to lo, as the SIMD max does.
+ */
+static inline int32_t
+quantize(float x, float lo, float hi)
+{
+	if (!(x >= lo))
+		x = lo;
+	if (x > hi)
+		x = hi;
+	return (lrintf(x));
+}
+
+static void
+copy_encode(char *dst, const float *src, size_t n, uint32_t *seed)
+{
+	memcpy(dst, src, n * sizeof(float));
+}
+
+static void
+copy_decode(float *dst, const char *src, size_t n)
+{
+	memcpy(dst, src, n * sizeof(float));
+}
+
+static void
+s16_encode(char *dst, const float *src, size_t n, uint32_t *seed)
+{
+	size_t i;
+	int32_t v;
+	float x;
+
+	for (i=0; i < n; i++) {
+		x = src[i] * S16_SCALE;
+		if (seed != NULL)
+			x += tpdf(seed);
+		v = quantize(x, -S16_SCALE, S16_SCALE - 1);
+		dst[2*i] = v;
+		dst[2*i + 1] = v >> 8;
+	}
+}
+
+static void
+s16_decode(float *dst, const char *src, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)src;
+	size_t i;
+
+	for (i=0; i < n; i++)
+		dst[i] = (int16_t)(p[2*i] | p[2*i + 1] << 8) / S16_SCALE;
+}
+
+static void
+s24_encode(char *dst, const float *src, size_t n, uint32_t *seed)
+{
+	size_t i;
+	int32_t v;
+
+	for (i=0; i < n; i++) {
+		v = quantize(src[i] * S24_SCALE, -S24_SCALE, S24_SCALE - 1);
+		dst[3*i] = v;
+		dst[3*i + 1] = v >> 8;
+		dst[3*i + 2] = v >> 16;
+	}
+}
+
+static void
+s24_decode(float *dst, const char *src, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)src;
+	size_t i;
+	int32_t v;
+
+	for (i=0; i < n; i++) {
+		v = (uint32_t)p[3*i] << 8 | (uint32_t)p[3*i + 1] << 16 |
+			(uint32_t)p[3*i + 2] << 24;
+		dst[i] = (v >> 8) / S24_SCALE;
+	}
+}
+
+/* float to half, rounding to nearest even */
+static uint16_t
+half(float f)
+{
+	uint32_t x, sign, m, h, rem, mid;
+	int e, shift;
+
+	memcpy(&x, &f, sizeof(x));
+	sign = (x >> 16) & 0x8000;
+	e = (x >> 23) & 0xff;
+	m = x & 0x7fffff;
+	if (e == 0xff)				/* inf, NaN */
+		return (sign | 0x7c00 | (m != 0 ? 0x200 : 0));
+	e = e - 127 + 15;
+	if (e >= 31)				/* too big: inf */
+		return (sign | 0x7c00);
+	if (e <= 0) {				/* subnormal */
+		if (e < -10)
+			return (sign);
+		m |= 0x800000;
+		shift = 14 - e;
+	} else {
+		m |= e << 23;			/* exponent carries on */
+		shift = 13;
+	}
+	h = m >> shift;
+	rem = m & ((1u << shift) - 1);
+	mid = 1u << (shift - 1);
+	if (rem > mid || (rem == mid && (h & 1)))
+		h++;
+	return (sign | h);
+}
+
+static float
+unhalf(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff, x;
+	float f;
+
+	if (e == 0x1f) {
+		x = sign | 0x7f800000 | m << 13;
+	} else if (e != 0) {
+		x = sign | (e + 112) << 23 | m << 13;
+	} else if (m == 0) {
+		x = sign;
+	} else {				/* subnormal: normalize it */
+		for (e=113; !(m & 0x400); e--)
+			m <<= 1;
+		x = sign | e << 23 | (m & 0x3ff) << 13;
+	}
+	memcpy(&f, &x, sizeof(f));
+	return (f);
+}
+
+static void
+f16_encode(char *dst, const float *src, size_t n, uint32_t *seed)
+{
+	size_t i;
+	uint16_t h;
+
+	for (i=0; i < n; i++) {
+		h = half(src[i]);
+		dst[2*i] = h;
+		dst[2*i + 1] = h >> 8;
+	}
+}
+
+static void
+f16_decode(float *dst, const char *src, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)src;
+	size_t i;
+
+	for (i=0; i < n; i++)
+		dst[i] = unhalf(p[2*i] | p[2*i + 1] << 8);
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * SSE2: int16 only.  cvtps_epi32 rounds to nearest even like lrintf, and
+ * packs_epi32 narrows to 16 bits.
+ */
+static inline __m128i
+xorshift_sse2(__m128i x)
+{
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	return (_mm_xor_si128(x, _mm_slli_epi32(x, 5)));
+}
+
+static inline __m128
+tpdf_sse2(__m128i *s)
+{
+	__m128 a, b;
+
+	*s = xorshift_sse2(*s);
+	a = _mm_cvtepi32_ps(_mm_srli_epi32(*s, 16));
+	b = _mm_cvtepi32_ps(_mm_and_si128(*s, _mm_set1_epi32(0xffff)));
+	return (_mm_mul_ps(_mm_sub_ps(a, b), _mm_set1_ps(1.0f / 65536.0f)));
+}
+
+static void
+s16_encode_sse2(char *dst, const float *src, size_t n, uint32_t *seed)
+{
+	const __m128 scale = _mm_set1_ps(S16_SCALE);
+	const __m128 lo = _mm_set1_ps(-S16_SCALE), hi = _mm_set1_ps(S16_SCALE - 1);
+	__m128i s = _mm_setzero_si128();
+	__m128 a, b;
+	size_t i;
+
+	if (seed != NULL)
+		s = _mm_loadu_si128((__m128i *)seed);
+	for (i=0; i + 8 <= n; i += 8) {
+		a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+		b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+		if (seed != NULL) {
+			a = _mm_add_ps(a, tpdf_sse2(&s));
+			b = _mm_add_ps(b, tpdf_sse2(&s));
+		}
+		a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+		b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+		_mm_storeu_si128((__m128i *)(dst + 2*i), _mm_packs_epi32(
+			_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+	}
+	if (seed != NULL)
+		_mm_storeu_si128((__m128i *)seed, s);
+	s16_encode(dst + 2*i, src + i, n - i, seed);
+}
+
+static void
+s16_decode_sse2(float *dst, const char *src, size_t n)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / S16_SCALE);
+	__m128i x;
+	size_t i;
+
+	for (i=0; i + 8 <= n; i += 8) {
+		x = _mm_loadu_si128((const __m128i *)(src + 2*i));
+		/* sign extend each half to 32 bits */
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(
+			_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)), scale));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(
+			_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)), scale));
+	}
+	s16_decode(dst + i, src + 2*i, n - i);
+}
+
+/*
+ * AVX2.  packs_epi32 works within 128 bit lanes, so its result is put back
+ * in order with a permute.  Packed 24 bit samples are shuffled four to each
+ * 128 bit lane and stored 12 bytes at a time; each store writes 4 bytes of
+ * junk past its samples, which the next store overwrites, so the vector
+ * loop stops with room for that to spare.
+ */
+#define AVX2	__attribute__((target("avx2")))
+#define F16C	__attribute__((target("avx2,f16c")))
+
+static inline AVX2 __m256i
+xorshift_avx2(__m256i x)
+{
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	return (_mm256_xor_si256(x, _mm256_slli_epi32(x, 5)));
+}
+
+static inline AVX2 __m256
+tpdf_avx2(__m256i *s)
+{
+	__m256 a, b;
+
+	*s = xorshift_avx2(*s);
+	a = _mm256_cvtepi32_ps(_mm256_srli_epi32(*s, 16));
+	b = _mm256_cvtepi32_ps(_mm256_and_si256(*s, _mm256_set1_epi32(0xffff)));
+	return (_mm256_mul_ps(_mm256_sub_ps(a, b),
+		_mm256_set1_ps(1.0f / 65536.0f)));
+}
+
+static AVX2 void
+s16_encode_avx2(char *dst, const float *src, size_t n, uint32_t *seed)
+{
+	const __m256 scale = _mm256_set1_ps(S16_SCALE);
+	const __m256 lo = _mm256_set1_ps(-S16_SCALE);
+	const __m256 hi = _mm256_set1_ps(S16_SCALE - 1);
+	__m256i s = _mm256_setzero_si256(), p;
+	__m256 a, b;
+	size_t i;
+
+	if (seed != NULL)
+		s = _mm256_loadu_si256((__m256i *)seed);
+	for (i=0; i + 16 <= n; i += 16) {
+		a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+		b = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale);
+		if (seed != NULL) {
+			a = _mm256_add_ps(a, tpdf_avx2(&s));
+			b = _mm256_add_ps(b, tpdf_avx2(&s));
+		}
+		a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+		b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+		p = _mm256_packs_epi32(_mm256_cvtps_epi32(a),
+			_mm256_cvtps_epi32(b));
+		_mm256_storeu_si256((__m256i *)(dst + 2*i),
+			_mm256_permute4x64_epi64(p, 0xd8));
+	}
+	if (seed != NULL)
+		_mm256_storeu_si256((__m256i *)seed, s);
+	s16_encode(dst + 2*i, src + i, n - i, seed);
+}
+
+static AVX2 void
+s16_decode_avx2(float *dst, const char *src, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / S16_SCALE);
+	__m256i x;
+	size_t i;
+
+	for (i=0; i + 8 <= n; i += 8) {
+		x = _mm256_cvtepi16_epi32(_mm_loadu_si128(
+			(const __m128i *)(src + 2*i)));
+		_mm256_storeu_ps(dst + i,
+			_mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+	s16_decode(dst + i, src + 2*i, n - i);
+}
+
+static AVX2 void
+s24_encode_avx2(char *dst, const float *src, size_t n, uint32_t *seed)
+{
+	const __m256 scale = _mm256_set1_ps(S24_SCALE);
+	const __m256 lo = _mm256_set1_ps(-S24_SCALE);
+	const __m256 hi = _mm256_set1_ps(S24_SCALE - 1);
+	const __m256i pack = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m256i x;
+	__m256 a;
+	size_t i;
+
+	for (i=0; i + 10 <= n; i += 8) {
+		a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+		a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+		x = _mm256_shuffle_epi8(_mm256_cvtps_epi32(a), pack);
+		_mm_storeu_si128((__m128i *)(dst + 3*i),
+			_mm256_castsi256_si128(x));
+		_mm_storeu_si128((__m128i *)(dst + 3*i + 12),
+			_mm256_extracti128_si256(x, 1));
+	}
+	s24_encode(dst + 3*i, src + i, n - i, seed);
+}
+
+static AVX2 void
+s24_decode_avx2(float *dst, const char *src, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / S24_SCALE);
+	/* each sample to the top three bytes of a word, then shift down */
+	const __m256i unpack = _mm256_setr_epi8(
+		-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+		-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	__m256i x;
+	size_t i;
+
+	for (i=0; i + 10 <= n; i += 8) {
+		x = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const __m128i *)(src + 3*i))),
+			_mm_loadu_si128((const __m128i *)(src + 3*i + 12)), 1);
+		x = _mm256_srai_epi32(_mm256_shuffle_epi8(x, unpack), 8);
+		_mm256_storeu_ps(dst + i,
+			_mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+	s24_decode(dst + i, src + 3*i, n - i);
+}
+
+static F16C void
+f16_encode_f16c(char *dst, const float *src, size_t n, uint32_t *seed)
+{
+	size_t i;
+
+	for (i=0; i + 8 <= n; i += 8)
+		_mm_storeu_si128((__m128i *)(dst + 2*i), _mm256_cvtps_ph(
+			_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+	f16_encode(dst + 2*i, src + i, n - i, seed);
+}
+
+static F16C void
+f16_decode_f16c(float *dst, const char *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(
+			_mm_loadu_si128((const __m128i *)(src + 2*i))));
+	f16_decode(dst + i, src + 2*i, n - i);
+}
+#endif /* HAVE_X86_SIMD */
+
+#define NFORMATS	4	/* FORMAT_FLOAT32 .. FORMAT_FLOAT16 */
+
+static const struct convert_kernel scalar[NFORMATS] = {
+	{ "copy", FORMAT_FLOAT32, 4, copy_encode, copy_decode },
+	{ "s16", FORMAT_INT16, 2, s16_encode, s16_decode },
+	{ "s24", FORMAT_INT24, 3, s24_encode, s24_decode },
+	{ "f16", FORMAT_FLOAT16, 2, f16_encode, f16_decode },
+};
+
+#ifdef HAVE_X86_SIMD
+static const struct convert_kernel sse2[NFORMATS] = {
+	{ "copy", FORMAT_FLOAT32, 4, copy_encode, copy_decode },
+	{ "s16/sse2", FORMAT_INT16, 2, s16_encode_sse2, s16_decode_sse2 },
+	{ "s24", FORMAT_INT24, 3, s24_encode, s24_decode },
+	{ "f16", FORMAT_FLOAT16, 2, f16_encode, f16_decode },
+};
+
+static const struct convert_kernel avx2[NFORMATS] = {
+	{ "copy", FORMAT_FLOAT32, 4, copy_encode, copy_decode },
+	{ "s16/avx2", FORMAT_INT16, 2, s16_encode_avx2, s16_decode_avx2 },
+	{ "s24/avx2", FORMAT_INT24, 3, s24_encode_avx2, s24_decode_avx2 },
+	{ "f16/f16c", FORMAT_FLOAT16, 2, f16_encode_f16c, f16_decode_f16c },
+};
+#endif
+
+/*
+ * Kernel for format at a CPU level, which must not be above
+ * interleave_level().  NULL for a format that is not known.
+ */
+const struct convert_kernel *
+convert_lookup(int level, int format)
+{
+	if (format < FORMAT_FLOAT32 || format > FORMAT_FLOAT16)
+		return (NULL);
+#ifdef HAVE_X86_SIMD
+	if (level >= IL_AVX2 && (format != FORMAT_FLOAT16 ||
+	    __builtin_cpu_supports("f16c")))
+		return (&avx2[format - 1]);
+	if (level >= IL_SSE2)
+		return (&sse2[format - 1]);
+#endif
+	return (&scalar[format - 1]);
+}
+
+/* Best kernel for format on this CPU; interleave_init must have been run */
+const struct convert_kernel *
+convert_select(int format)
+{
+	return (convert_lookup(interleave_level(), format));
+}
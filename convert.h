@@ -0,0 +1,40 @@
+/*
+ * convert - store samples in reduced precision formats
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DITHER_LANES	8	/* seed words of the dither generator */
+
+/*
+ * Convert n samples from the JACK float format to the stored format.  With
+ * seed (DITHER_LANES words, not all zero), int16 samples are dithered.
+ */
+typedef void (*encode_fn)(char *dst, const float *src, size_t n,
+	uint32_t *seed);
+
+/* The reverse, n stored samples to floats */
+typedef void (*decode_fn)(float *dst, const char *src, size_t n);
+
+struct convert_kernel {
+	const char *name;
+	int format;		/* FORMAT_* in format.h */
+	int size;		/* bytes of a stored sample */
+	encode_fn encode;
+	decode_fn decode;
+};
+
+const struct convert_kernel *convert_lookup(int level, int format);
+const struct convert_kernel *convert_select(int format);
+void dither_init(uint32_t *seed);
+
+#endif /* CONVERT_H */
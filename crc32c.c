@@ -0,0 +1,144 @@
+/*
+ * crc32c - CRC-32C (Castagnoli) checksums
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * Chunks of a capture file carry the CRC-32C of their header and payload.
+ * It is the CRC that x86 (SSE4.2 crc32) and ARMv8 (the CRC extension)
+ * compute in hardware, eight bytes an instruction; other CPUs use a table.
+ * crc32c_init picks the version for this CPU.
+ */
+
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_CRC	1
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_ARM_CRC	1
+#endif
+
+#define POLY	0x82f63b78	/* Castagnoli, bit reversed */
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t table[256];
+
+static uint32_t
+crc_table(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len-- > 0)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return (crc);
+}
+
+#ifdef HAVE_X86_CRC
+#define SSE42	__attribute__((target("sse4.2")))
+
+static SSE42 uint32_t
+crc_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	/* bytes up to an 8 byte boundary, whole words, then the rest */
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+#ifdef __x86_64__
+	{
+		uint64_t c = crc, w;
+
+		for (; len >= 8; len -= 8, p += 8) {
+			memcpy(&w, p, 8);
+			c = _mm_crc32_u64(c, w);
+		}
+		crc = c;
+	}
+#else
+	{
+		uint32_t w;
+
+		for (; len >= 4; len -= 4, p += 4) {
+			memcpy(&w, p, 4);
+			crc = _mm_crc32_u32(crc, w);
+		}
+	}
+#endif
+	while (len-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+	return (crc);
+}
+#endif
+
+#ifdef HAVE_ARM_CRC
+#define ARMCRC	__attribute__((target("+crc")))
+
+static ARMCRC uint32_t
+crc_armv8(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t w;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		crc = __crc32cb(crc, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		crc = __crc32cd(crc, w);
+	}
+	while (len-- > 0)
+		crc = __crc32cb(crc, *p++);
+	return (crc);
+}
+#endif
+
+static crc_fn crc_best = crc_table;
+static const char *crc_best_name = "table";
+
+/*
+ * Build the table and find out what this CPU can do.  Called once before
+ * any threads are started.
+ */
+void
+crc32c_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i=0; i < 256; i++) {
+		c = i;
+		for (j=0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+		table[i] = c;
+	}
+#ifdef HAVE_X86_CRC
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc_best = crc_sse42;
+		crc_best_name = "sse4.2";
+	}
+#endif
+#ifdef HAVE_ARM_CRC
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc_best = crc_armv8;
+		crc_best_name = "armv8";
+	}
+#endif
+}
+
+const char *
+crc32c_name(void)
+{
+	return (crc_best_name);
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return (~crc_best(~crc, buf, len));
+}
@@ -0,0 +1,25 @@
+/*
+ * crc32c - CRC-32C (Castagnoli) checksums
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void crc32c_init(void);
+const char *crc32c_name(void);
+
+/*
+ * CRC of len bytes of buf, continuing from crc, which is 0 to start.  The
+ * CRC of a buffer is the same however it is split up between calls.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32C_H */
@@ -0,0 +1,466 @@
+/*
+ * format - jack_cat file header
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * A version 2 file starts with a fixed 64 byte preamble, all fields
+ * little-endian:
+ *
+ *	 0  8	magic "JACK_CAT"
+ *	 8  4	version (2)
+ *	12  4	header length; the first frame starts here
+ *	16  4	channels
+ *	20  4	sample format
+ *	24  4	sample rate
+ *	28  4	jack period, frames
+ *	32  8	jack frame time of the first frame
+ *	40  8	wall clock time of the first frame, ns since 1970
+ *	48  4	length of the port names
+ *	52  4	chunk payload size, 0 for a flat stream
+ *	56  4	chunk alignment
+ *	60  4	chunk payload codec, 0 for none
+ *
+ * followed by the port names, NUL terminated, one per channel, and zeros
+ * up to a multiple of FORMAT_ALIGN so the data that follows is aligned for
+ * O_DIRECT and for the mapping used by playback.
+ *
+ * In a flat file the interleaved frames follow the header.  A chunked file
+ * is a sequence of chunks, each starting at a multiple of the chunk
+ * alignment (counted from the end of the header):
+ *
+ *	 0  4	magic "JCHK"
+ *	 4  4	payload length
+ *	 8  8	first frame, counted from the start of the file
+ *	16  4	frames in the chunk
+ *	20  4	flags
+ *	24  4	CRC-32C, if the CHUNK_CRC flag is set
+ *	28  4	reserved, zero
+ *
+ * then the payload.  In a file with a codec, a chunk with the CHUNK_CODED
+ * flag holds its frames encoded by codec.c; the others hold them as they
+ * are, which is what the capture does when encoding does not make a chunk
+ * smaller.  A chunk with the CHUNK_SILENT flag has no payload and stands
+ * for frames frames of silence; with CHUNK_GAP as well, frames the capture
+ * lost (a dropped period or a jack xrun).  The CRC is of the header up to
+ * it and then the payload, so it covers where the chunk says it is as well
+ * as what is in it.  When the file is closed an index follows the last
+ * chunk: a 16 byte entry (first frame, offset of the chunk header) for
+ * every chunk, then a footer:
+ *
+ *	 0  8	magic "JCINDEX\0"
+ *	 8  8	count of entries
+ *	16  8	file offset of the first entry
+ *	24  8	reserved, zero
+ *
+ * If the index is missing (the capture did not finish) it is rebuilt by
+ * walking the chunk headers; only a chunk that was being written is lost.
+ *
+ * Version 1 (legacy) files start with "JACK#" and a NUL, where # is the
+ * count of channels, and the data follows immediately.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include "format.h"
+#include "crc32c.h"
+
+static void
+put32(char *p, uint32_t v)
+{
+	int i;
+
+	for (i=0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void
+put64(char *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static uint32_t
+get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+
+	return (u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24);
+}
+
+static uint64_t
+get64(const char *p)
+{
+	return (get32(p) | (uint64_t)get32(p + 4) << 32);
+}
+
+/* Bytes of port names */
+static size_t
+names_size(const struct file_header *h)
+{
+	size_t n = 0;
+	int i;
+
+	if (h->names == NULL)
+		return (0);
+	for (i=0; i < h->channels; i++)
+		n += strlen(h->names[i]) + 1;
+	return (n);
+}
+
+/* Length of the version 2 header for h */
+size_t
+header_size(const struct file_header *h)
+{
+	size_t n = FORMAT_PREAMBLE + names_size(h);
+
+	return ((n + FORMAT_ALIGN - 1) & ~(size_t)(FORMAT_ALIGN - 1));
+}
+
+/* Encode h as a version 2 header into buf, which has header_size bytes */
+void
+header_encode(const struct file_header *h, char *buf)
+{
+	size_t len = header_size(h);
+	char *p;
+	int i;
+
+	memset(buf, 0, len);
+	memcpy(buf, FORMAT_MAGIC, 8);
+	put32(buf + 8, FORMAT_VERSION);
+	put32(buf + 12, len);
+	put32(buf + 16, h->channels);
+	put32(buf + 20, h->format);
+	put32(buf + 24, h->rate);
+	put32(buf + 28, h->period);
+	put64(buf + 32, h->start_frame);
+	put64(buf + 40, h->start_ns);
+	put32(buf + 48, names_size(h));
+	put32(buf + 52, h->chunk);
+	put32(buf + 56, h->align);
+	put32(buf + 60, h->codec);
+	p = buf + FORMAT_PREAMBLE;
+	for (i=0; h->names != NULL && i < h->channels; i++) {
+		strcpy(p, h->names[i]);
+		p += strlen(h->names[i]) + 1;
+	}
+}
+
+/* Legacy "JACK#\0" header in the first n bytes of buf */
+static int
+header_legacy(struct file_header *h, const char *buf, size_t n)
+{
+	size_t i;
+
+	for (i=4; i < n && isdigit((unsigned char)buf[i]); i++)
+		;
+	if (i == 4 || i >= n || buf[i] != '\0')
+		return (-1);
+	h->version = 1;
+	h->len = i + 1;
+	h->channels = atoi(buf + 4);
+	h->format = FORMAT_FLOAT32;
+	return (0);
+}
+
+/*
+ * Read and check the header of the file open on fd, and leave the file
+ * offset at the first frame.  Returns -1, with a message, if it is not a
+ * file jack_cat can play.
+ */
+int
+header_read(int fd, struct file_header *h)
+{
+	char buf[FORMAT_PREAMBLE];
+	char *names, *p;
+	ssize_t n;
+	size_t nlen;
+	int i;
+
+	memset(h, 0, sizeof(struct file_header));
+	n = pread(fd, buf, FORMAT_PREAMBLE, 0);
+	if (n >= 6 && memcmp(buf, "JACK", 4) == 0 &&
+	    header_legacy(h, buf, n) == 0) {
+		lseek(fd, h->len, SEEK_SET);
+		return (0);
+	}
+	if (n < FORMAT_PREAMBLE || memcmp(buf, FORMAT_MAGIC, 8) != 0) {
+		fprintf(stderr, "not a jack_cat file\n");
+		return (-1);
+	}
+	h->version = get32(buf + 8);
+	if (h->version != FORMAT_VERSION) {
+		fprintf(stderr, "unsupported file version %d\n", h->version);
+		return (-1);
+	}
+	h->len = get32(buf + 12);
+	h->channels = get32(buf + 16);
+	h->format = get32(buf + 20);
+	h->rate = get32(buf + 24);
+	h->period = get32(buf + 28);
+	h->start_frame = get64(buf + 32);
+	h->start_ns = get64(buf + 40);
+	nlen = get32(buf + 48);
+	h->chunk = get32(buf + 52);
+	h->align = get32(buf + 56);
+	if (h->align == 0)
+		h->align = 1;
+	h->codec = get32(buf + 60);
+	if (h->channels <= 0 || h->len < FORMAT_PREAMBLE + nlen) {
+		fprintf(stderr, "corrupt file header\n");
+		return (-1);
+	}
+
+	/* port names, if there is one for every channel */
+	if (nlen > 0) {
+		names = malloc(nlen + 1);
+		h->names = calloc(h->channels, sizeof(char *));
+		n = pread(fd, names, nlen, FORMAT_PREAMBLE);
+		names[n > 0 ? n : 0] = '\0';
+		p = names;
+		for (i=0; i < h->channels && p < names + n; i++) {
+			h->names[i] = p;
+			p += strlen(p) + 1;
+		}
+		if (i < h->channels) {
+			free(names);
+			free(h->names);
+			h->names = NULL;
+		}
+	}
+	lseek(fd, h->len, SEEK_SET);
+	return (0);
+}
+
+/* Free what header_read allocated */
+void
+header_free(struct file_header *h)
+{
+	if (h->names != NULL) {
+		free(h->names[0]);
+		free(h->names);
+		h->names = NULL;
+	}
+}
+
+const char *
+header_format_name(int format)
+{
+	switch (format) {
+	case FORMAT_FLOAT32:	return ("float32");
+	case FORMAT_INT16:	return ("int16");
+	case FORMAT_INT24:	return ("int24");
+	case FORMAT_FLOAT16:	return ("float16");
+	default:		return ("unknown");
+	}
+}
+
+/* The format called name, or -1 */
+int
+header_format(const char *name)
+{
+	int f;
+
+	for (f=FORMAT_FLOAT32; f <= FORMAT_FLOAT16; f++) {
+		if (strcmp(name, header_format_name(f)) == 0)
+			return (f);
+	}
+	return (-1);
+}
+
+/* Bytes of a stored sample, 0 for an unknown format */
+size_t
+header_sample_size(int format)
+{
+	switch (format) {
+	case FORMAT_FLOAT32:	return (4);
+	case FORMAT_INT16:	return (2);
+	case FORMAT_INT24:	return (3);
+	case FORMAT_FLOAT16:	return (2);
+	default:		return (0);
+	}
+}
+
+/* Bytes of a stored frame */
+size_t
+header_frame_size(const struct file_header *h)
+{
+	return (h->channels * header_sample_size(h->format));
+}
+
+/* Space a chunk with len bytes of payload takes, up to the next chunk */
+size_t
+chunk_stride(const struct file_header *h, size_t len)
+{
+	size_t n = CHUNK_HDR_LEN + len;
+
+	return ((n + h->align - 1) / h->align * h->align);
+}
+
+void
+chunk_encode(const struct chunk *k, char *buf)
+{
+	memset(buf, 0, CHUNK_HDR_LEN);
+	memcpy(buf, CHUNK_MAGIC, 4);
+	put32(buf + 4, k->len);
+	put64(buf + 8, k->frame);
+	put32(buf + 16, k->frames);
+	put32(buf + 20, k->flags);
+	put32(buf + 24, k->crc);
+}
+
+/* Returns -1 if buf is not a chunk header */
+int
+chunk_decode(struct chunk *k, const char *buf)
+{
+	if (memcmp(buf, CHUNK_MAGIC, 4) != 0)
+		return (-1);
+	k->len = get32(buf + 4);
+	k->frame = get64(buf + 8);
+	k->frames = get32(buf + 16);
+	k->flags = get32(buf + 20);
+	k->crc = get32(buf + 24);
+	return (0);
+}
+
+/*
+ * Set the CRC in the header in buf of a chunk with CHUNK_CRC, from the
+ * header and the len bytes of payload that follow it.
+ */
+void
+chunk_seal(char *buf, size_t len)
+{
+	uint32_t crc;
+
+	crc = crc32c(0, buf, CHUNK_CRC_OFF);
+	put32(buf + CHUNK_CRC_OFF, crc32c(crc, buf + CHUNK_HDR_LEN, len));
+}
+
+void
+index_add(struct chunk_index *x, uint64_t frame, uint64_t off)
+{
+	if (x->n == x->size) {
+		x->size = x->size ? x->size * 2 : 1024;
+		x->e = realloc(x->e, x->size * sizeof(struct chunk_entry));
+	}
+	x->e[x->n].frame = frame;
+	x->e[x->n].off = off;
+	x->n++;
+}
+
+/* Bytes of the index and its footer */
+size_t
+index_size(const struct chunk_index *x)
+{
+	return (x->n * INDEX_ENTRY_LEN + INDEX_FOOTER_LEN);
+}
+
+/* Encode the index, to be written at file offset off, into buf */
+void
+index_encode(const struct chunk_index *x, uint64_t off, char *buf)
+{
+	size_t i;
+
+	for (i=0; i < x->n; i++) {
+		put64(buf, x->e[i].frame);
+		put64(buf + 8, x->e[i].off);
+		buf += INDEX_ENTRY_LEN;
+	}
+	memset(buf, 0, INDEX_FOOTER_LEN);
+	memcpy(buf, INDEX_MAGIC, 8);
+	put64(buf + 8, x->n);
+	put64(buf + 16, off);
+}
+
+/* Rebuild the index of a file that has none by walking the chunks */
+static int
+index_scan(int fd, const struct file_header *h, off_t size,
+	struct chunk_index *x)
+{
+	char buf[CHUNK_HDR_LEN];
+	struct chunk k;
+	off_t off = h->len;
+
+	while (off + CHUNK_HDR_LEN <= size) {
+		if (pread(fd, buf, CHUNK_HDR_LEN, off) != CHUNK_HDR_LEN ||
+		    chunk_decode(&k, buf) == -1 || k.len > h->chunk ||
+		    off + CHUNK_HDR_LEN + k.len > size)
+			break;
+		index_add(x, k.frame, off);
+		off += chunk_stride(h, k.len);
+	}
+	if (off < size)
+		fprintf(stderr, "%ld bytes at the end are not whole chunks\n",
+			(long)(size - off));
+	return (0);
+}
+
+/*
+ * Load the index of a chunked file, or rebuild it if the capture did not
+ * get to write one.
+ */
+int
+index_read(int fd, const struct file_header *h, struct chunk_index *x)
+{
+	char foot[INDEX_FOOTER_LEN];
+	char *buf;
+	off_t size, off;
+	uint64_t n, i;
+
+	memset(x, 0, sizeof(struct chunk_index));
+	if ((size = lseek(fd, 0, SEEK_END)) == -1)
+		return (-1);
+	lseek(fd, h->len, SEEK_SET);
+	if (size < h->len + INDEX_FOOTER_LEN ||
+	    pread(fd, foot, INDEX_FOOTER_LEN, size - INDEX_FOOTER_LEN) !=
+	    INDEX_FOOTER_LEN || memcmp(foot, INDEX_MAGIC, 8) != 0)
+		goto scan;
+	n = get64(foot + 8);
+	off = get64(foot + 16);
+	if (off < h->len || off + n * INDEX_ENTRY_LEN + INDEX_FOOTER_LEN != size)
+		goto scan;
+	buf = malloc(n * INDEX_ENTRY_LEN + 1);
+	if (pread(fd, buf, n * INDEX_ENTRY_LEN, off) != n * INDEX_ENTRY_LEN) {
+		free(buf);
+		goto scan;
+	}
+	for (i=0; i < n; i++)
+		index_add(x, get64(buf + i * INDEX_ENTRY_LEN),
+			get64(buf + i * INDEX_ENTRY_LEN + 8));
+	free(buf);
+	return (0);
+
+scan:
+	fprintf(stderr, "no chunk index, rebuilding it\n");
+	return (index_scan(fd, h, size, x));
+}
+
+/* The chunk holding frame: the last one that starts at or before it */
+size_t
+index_find(const struct chunk_index *x, uint64_t frame)
+{
+	size_t lo = 0, hi = x->n, mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (x->e[mid].frame <= frame)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+void
+index_free(struct chunk_index *x)
+{
+	free(x->e);
+	memset(x, 0, sizeof(struct chunk_index));
+}
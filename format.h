@@ -0,0 +1,97 @@
+/*
+ * format - jack_cat file header
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FORMAT_MAGIC	"JACK_CAT"	/* first 8 bytes of a version 2 file */
+#define FORMAT_VERSION	2
+#define FORMAT_ALIGN	4096		/* header is padded to a multiple */
+#define FORMAT_PREAMBLE	64		/* fixed part of the header */
+
+/* sample formats */
+#define FORMAT_FLOAT32	1		/* 32 bit float, little-endian */
+#define FORMAT_INT16	2		/* 16 bit integer */
+#define FORMAT_INT24	3		/* 24 bit integer, packed in 3 bytes */
+#define FORMAT_FLOAT16	4		/* IEEE half precision float */
+
+/* chunk payload codecs */
+#define CODEC_NONE	0
+#define CODEC_XOR	1		/* codec.c, chunks with CHUNK_CODED */
+
+#define CHUNK_MAGIC	"JCHK"
+#define CHUNK_HDR_LEN	32		/* chunk header */
+#define CHUNK_CODED	1		/* chunk flag: payload is encoded */
+#define CHUNK_SILENT	2		/* no payload: frames of silence */
+#define CHUNK_CRC	4		/* chunk flag: crc is set */
+#define CHUNK_GAP	8		/* silent chunk: frames the capture lost */
+#define CHUNK_CRC_OFF	24		/* crc covers the header up to here */
+#define INDEX_MAGIC	"JCINDEX"
+#define INDEX_ENTRY_LEN	16		/* frame, offset */
+#define INDEX_FOOTER_LEN 32
+
+struct file_header {
+	int version;		/* 1 for a legacy "JACK#" file */
+	size_t len;		/* header bytes, the first frame follows */
+	int channels;
+	int format;		/* FORMAT_FLOAT32, ... */
+	int rate;		/* sample rate, 0 if unknown */
+	int period;		/* jack period, frames, 0 if unknown */
+	uint64_t start_frame;	/* jack frame time of the first frame */
+	uint64_t start_ns;	/* wall clock of the first frame, ns since 1970 */
+	char **names;		/* channels port names, NULL if none */
+	int chunk;		/* chunk payload size, 0 for a flat stream */
+	int align;		/* chunks start at a multiple of this */
+	int codec;		/* CODEC_XOR if chunks may be encoded */
+};
+
+/* One chunk of a chunked file: CHUNK_HDR_LEN header, then len bytes */
+struct chunk {
+	uint32_t len;		/* bytes of payload, as stored */
+	uint64_t frame;		/* first frame, counted from the file start */
+	uint32_t frames;	/* frames in the chunk */
+	uint32_t flags;
+	uint32_t crc;		/* CRC-32C of the header and the payload */
+};
+
+/* Where each chunk is, in file order */
+struct chunk_entry {
+	uint64_t frame;		/* first frame of the chunk */
+	uint64_t off;		/* file offset of the chunk header */
+};
+
+struct chunk_index {
+	struct chunk_entry *e;
+	size_t n, size;
+};
+
+size_t header_size(const struct file_header *h);
+void header_encode(const struct file_header *h, char *buf);
+int header_read(int fd, struct file_header *h);
+void header_free(struct file_header *h);
+const char *header_format_name(int format);
+int header_format(const char *name);
+size_t header_sample_size(int format);
+size_t header_frame_size(const struct file_header *h);
+
+size_t chunk_stride(const struct file_header *h, size_t len);
+void chunk_encode(const struct chunk *k, char *buf);
+int chunk_decode(struct chunk *k, const char *buf);
+void chunk_seal(char *buf, size_t len);
+void index_add(struct chunk_index *x, uint64_t frame, uint64_t off);
+size_t index_size(const struct chunk_index *x);
+void index_encode(const struct chunk_index *x, uint64_t off, char *buf);
+int index_read(int fd, const struct file_header *h, struct chunk_index *x);
+size_t index_find(const struct chunk_index *x, uint64_t frame);
+void index_free(struct chunk_index *x);
+
+#endif /* FORMAT_H */
@@ -0,0 +1,580 @@
+/*
+ * interleave - move samples between JACK port buffers and interleaved frames
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * The file format stores one frame (a sample from every port) after another.
+ * JACK hands us one buffer per port.  Converting between the two is a matrix
+ * transpose: the SIMD kernels load a square block of samples (4 ports x 4
+ * frames for SSE2, 8 x 8 for AVX2), transpose it in registers and store it.
+ * Ports left over after the last whole block, and frames left over at the end
+ * of the period, are done one sample at a time.
+ *
+ * Most sessions use 1, 2, 4 or 8 ports.  Those counts get their own kernels
+ * with the port count fixed at compile time: N port vectors are turned into
+ * N frame vectors by log2(N) rounds of a perfect shuffle ("zip" of vector i
+ * with vector i + N/2), and back again by the same number of "unzip" rounds.
+ * Every load and store is a whole vector of contiguous samples.
+ *
+ * interleave_select() picks a kernel for the port count from a table indexed
+ * by CPU level (scalar, SSE2, AVX2, AVX-512) and falls back to the generic
+ * kernel of that level.
+ */
+
+#include <string.h>
+#include "interleave.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD	1
+#endif
+
+static int cpu_level = IL_SCALAR;	/* best level this CPU supports */
+
+/*
+ * Scalar versions.  Also used for the leftovers of the SIMD versions:
+ * ports [p, nports) are moved for every frame.
+ */
+static void
+interleave_ports(float *dst, float **src, int p, int nports, size_t first,
+	size_t nframes)
+{
+	size_t f;
+	int i;
+
+	for (f=0; f < nframes; f++) {
+		for (i=p; i < nports; i++) {
+			dst[f*nports + i] = src[i][first + f];
+		}
+	}
+}
+
+static void
+deinterleave_ports(float **dst, const float *src, int p, int nports,
+	size_t first, size_t nframes)
+{
+	size_t f;
+	int i;
+
+	for (f=0; f < nframes; f++) {
+		for (i=p; i < nports; i++) {
+			dst[i][first + f] = src[f*nports + i];
+		}
+	}
+}
+
+/* One port: nothing to interleave */
+static void
+interleave_copy(float *dst, float **src, int nports, size_t first,
+	size_t nframes)
+{
+	memcpy(dst, src[0] + first, nframes * sizeof(float));
+}
+
+static void
+deinterleave_copy(float **dst, const float *src, int nports, size_t first,
+	size_t nframes)
+{
+	memcpy(dst[0] + first, src, nframes * sizeof(float));
+}
+
+static void
+interleave_scalar(float *dst, float **src, int nports, size_t first,
+	size_t nframes)
+{
+	interleave_ports(dst, src, 0, nports, first, nframes);
+}
+
+static void
+deinterleave_scalar(float **dst, const float *src, int nports, size_t first,
+	size_t nframes)
+{
+	deinterleave_ports(dst, src, 0, nports, first, nframes);
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * SSE2: groups of 4 ports starting at port p, 4 frames at a time.
+ * nframes must be a multiple of 4.  Returns the first port not handled.
+ */
+static int
+interleave_sse2_groups(float *dst, float **src, int p, int nports,
+	size_t first, size_t nframes)
+{
+	__m128 r0, r1, r2, r3;
+	size_t f;
+	float *d;
+
+	for (; p + 4 <= nports; p += 4) {
+		for (f=0; f < nframes; f += 4) {
+			r0 = _mm_loadu_ps(src[p+0] + first + f);
+			r1 = _mm_loadu_ps(src[p+1] + first + f);
+			r2 = _mm_loadu_ps(src[p+2] + first + f);
+			r3 = _mm_loadu_ps(src[p+3] + first + f);
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			d = dst + f*nports + p;
+			_mm_storeu_ps(d, r0);
+			_mm_storeu_ps(d + nports, r1);
+			_mm_storeu_ps(d + 2*nports, r2);
+			_mm_storeu_ps(d + 3*nports, r3);
+		}
+	}
+	return (p);
+}
+
+static int
+deinterleave_sse2_groups(float **dst, const float *src, int p, int nports,
+	size_t first, size_t nframes)
+{
+	__m128 r0, r1, r2, r3;
+	size_t f;
+	const float *s;
+
+	for (; p + 4 <= nports; p += 4) {
+		for (f=0; f < nframes; f += 4) {
+			s = src + f*nports + p;
+			r0 = _mm_loadu_ps(s);
+			r1 = _mm_loadu_ps(s + nports);
+			r2 = _mm_loadu_ps(s + 2*nports);
+			r3 = _mm_loadu_ps(s + 3*nports);
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			_mm_storeu_ps(dst[p+0] + first + f, r0);
+			_mm_storeu_ps(dst[p+1] + first + f, r1);
+			_mm_storeu_ps(dst[p+2] + first + f, r2);
+			_mm_storeu_ps(dst[p+3] + first + f, r3);
+		}
+	}
+	return (p);
+}
+
+static void
+interleave_sse2(float *dst, float **src, int nports, size_t first,
+	size_t nframes)
+{
+	size_t n4 = nframes & ~(size_t)3;
+	int p;
+
+	p = interleave_sse2_groups(dst, src, 0, nports, first, n4);
+	interleave_ports(dst, src, p, nports, first, n4);
+	interleave_ports(dst + n4*nports, src, 0, nports, first + n4,
+		nframes - n4);
+}
+
+static void
+deinterleave_sse2(float **dst, const float *src, int nports, size_t first,
+	size_t nframes)
+{
+	size_t n4 = nframes & ~(size_t)3;
+	int p;
+
+	p = deinterleave_sse2_groups(dst, src, 0, nports, first, n4);
+	deinterleave_ports(dst, src, p, nports, first, n4);
+	deinterleave_ports(dst, src + n4*nports, 0, nports, first + n4,
+		nframes - n4);
+}
+
+/*
+ * AVX2: groups of 8 ports, 8 frames at a time.  A remaining group of 4 ports
+ * goes through SSE2.
+ */
+#define AVX2	__attribute__((target("avx2")))
+
+static inline AVX2 void
+transpose8(__m256 *r)
+{
+	__m256 t0, t1, t2, t3, t4, t5, t6, t7;
+	__m256 u0, u1, u2, u3, u4, u5, u6, u7;
+
+	t0 = _mm256_unpacklo_ps(r[0], r[1]);
+	t1 = _mm256_unpackhi_ps(r[0], r[1]);
+	t2 = _mm256_unpacklo_ps(r[2], r[3]);
+	t3 = _mm256_unpackhi_ps(r[2], r[3]);
+	t4 = _mm256_unpacklo_ps(r[4], r[5]);
+	t5 = _mm256_unpackhi_ps(r[4], r[5]);
+	t6 = _mm256_unpacklo_ps(r[6], r[7]);
+	t7 = _mm256_unpackhi_ps(r[6], r[7]);
+	u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1,0,1,0));
+	u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3,2,3,2));
+	u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1,0,1,0));
+	u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3,2,3,2));
+	u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1,0,1,0));
+	u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3,2,3,2));
+	u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1,0,1,0));
+	u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3,2,3,2));
+	r[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+	r[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+	r[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+	r[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+	r[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+	r[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+	r[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+	r[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+
+static AVX2 void
+interleave_avx2(float *dst, float **src, int nports, size_t first,
+	size_t nframes)
+{
+	__m256 r[8];
+	size_t f, n8 = nframes & ~(size_t)7;
+	int p, k;
+
+	for (p=0; p + 8 <= nports; p += 8) {
+		for (f=0; f < n8; f += 8) {
+			for (k=0; k < 8; k++)
+				r[k] = _mm256_loadu_ps(src[p+k] + first + f);
+			transpose8(r);
+			for (k=0; k < 8; k++)
+				_mm256_storeu_ps(dst + (f+k)*nports + p, r[k]);
+		}
+	}
+	p = interleave_sse2_groups(dst, src, p, nports, first, n8);
+	interleave_ports(dst, src, p, nports, first, n8);
+	interleave_sse2(dst + n8*nports, src, nports, first + n8,
+		nframes - n8);
+}
+
+static AVX2 void
+deinterleave_avx2(float **dst, const float *src, int nports, size_t first,
+	size_t nframes)
+{
+	__m256 r[8];
+	size_t f, n8 = nframes & ~(size_t)7;
+	int p, k;
+
+	for (p=0; p + 8 <= nports; p += 8) {
+		for (f=0; f < n8; f += 8) {
+			for (k=0; k < 8; k++)
+				r[k] = _mm256_loadu_ps(src + (f+k)*nports + p);
+			transpose8(r);
+			for (k=0; k < 8; k++)
+				_mm256_storeu_ps(dst[p+k] + first + f, r[k]);
+		}
+	}
+	p = deinterleave_sse2_groups(dst, src, p, nports, first, n8);
+	deinterleave_ports(dst, src, p, nports, first, n8);
+	deinterleave_sse2(dst, src + n8*nports, nports, first + n8,
+		nframes - n8);
+}
+
+/*
+ * Fixed port count kernels.  isa names the instruction set, W is the number
+ * of floats in a vector, zlo/zhi zip the low/high halves of two vectors
+ * together and even/odd undo that.  Frames after the last whole vector are
+ * passed to the tail kernels.
+ */
+#define FIXED_KERNELS(isa, attr, vec, W, load, store, zlo, zhi, even, odd, \
+	N, tail, dtail)							\
+static attr void							\
+interleave_##isa##_##N(float *dst, float **src, int nports,		\
+	size_t first, size_t nframes)					\
+{									\
+	vec v[N], t[N];							\
+	size_t f, nw = nframes - nframes % W;				\
+	int i, w;							\
+									\
+	for (f=0; f < nw; f += W) {					\
+		_Pragma("GCC unroll 8")					\
+		for (i=0; i < N; i++)					\
+			v[i] = load(src[i] + first + f);		\
+		_Pragma("GCC unroll 3")					\
+		for (w=1; w < N; w <<= 1) {				\
+			_Pragma("GCC unroll 4")				\
+			for (i=0; i < N/2; i++) {			\
+				t[2*i] = zlo(v[i], v[i + N/2]);		\
+				t[2*i+1] = zhi(v[i], v[i + N/2]);	\
+			}						\
+			_Pragma("GCC unroll 8")				\
+			for (i=0; i < N; i++)				\
+				v[i] = t[i];				\
+		}							\
+		_Pragma("GCC unroll 8")					\
+		for (i=0; i < N; i++)					\
+			store(dst + f*N + i*W, v[i]);			\
+	}								\
+	tail(dst + nw*N, src, N, first + nw, nframes - nw);		\
+}									\
+									\
+static attr void							\
+deinterleave_##isa##_##N(float **dst, const float *src, int nports,	\
+	size_t first, size_t nframes)					\
+{									\
+	vec v[N], t[N];							\
+	size_t f, nw = nframes - nframes % W;				\
+	int i, w;							\
+									\
+	for (f=0; f < nw; f += W) {					\
+		_Pragma("GCC unroll 8")					\
+		for (i=0; i < N; i++)					\
+			v[i] = load(src + f*N + i*W);			\
+		_Pragma("GCC unroll 3")					\
+		for (w=1; w < N; w <<= 1) {				\
+			_Pragma("GCC unroll 4")				\
+			for (i=0; i < N/2; i++) {			\
+				t[i] = even(v[2*i], v[2*i+1]);		\
+				t[i + N/2] = odd(v[2*i], v[2*i+1]);	\
+			}						\
+			_Pragma("GCC unroll 8")				\
+			for (i=0; i < N; i++)				\
+				v[i] = t[i];				\
+		}							\
+		_Pragma("GCC unroll 8")					\
+		for (i=0; i < N; i++)					\
+			store(dst[i] + first + f, v[i]);		\
+	}								\
+	dtail(dst, src + nw*N, N, first + nw, nframes - nw);		\
+}
+
+/* SSE2 unpack is already a zip of two 4 float vectors */
+#define SSE2_EVEN(a, b)	_mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0))
+#define SSE2_ODD(a, b)	_mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1))
+
+FIXED_KERNELS(sse2, , __m128, 4, _mm_loadu_ps, _mm_storeu_ps,
+	_mm_unpacklo_ps, _mm_unpackhi_ps, SSE2_EVEN, SSE2_ODD, 2,
+	interleave_scalar, deinterleave_scalar)
+FIXED_KERNELS(sse2, , __m128, 4, _mm_loadu_ps, _mm_storeu_ps,
+	_mm_unpacklo_ps, _mm_unpackhi_ps, SSE2_EVEN, SSE2_ODD, 4,
+	interleave_scalar, deinterleave_scalar)
+FIXED_KERNELS(sse2, , __m128, 4, _mm_loadu_ps, _mm_storeu_ps,
+	_mm_unpacklo_ps, _mm_unpackhi_ps, SSE2_EVEN, SSE2_ODD, 8,
+	interleave_scalar, deinterleave_scalar)
+
+/*
+ * AVX2 unpack and shuffle work within 128 bit lanes; a lane permute
+ * makes them cross the whole vector.
+ */
+static inline AVX2 __m256
+avx2_zlo(__m256 a, __m256 b)
+{
+	return (_mm256_permute2f128_ps(_mm256_unpacklo_ps(a, b),
+		_mm256_unpackhi_ps(a, b), 0x20));
+}
+
+static inline AVX2 __m256
+avx2_zhi(__m256 a, __m256 b)
+{
+	return (_mm256_permute2f128_ps(_mm256_unpacklo_ps(a, b),
+		_mm256_unpackhi_ps(a, b), 0x31));
+}
+
+static inline AVX2 __m256
+avx2_even(__m256 a, __m256 b)
+{
+	__m256 e = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+
+	return (_mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(e),
+		_MM_SHUFFLE(3,1,2,0))));
+}
+
+static inline AVX2 __m256
+avx2_odd(__m256 a, __m256 b)
+{
+	__m256 o = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+
+	return (_mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(o),
+		_MM_SHUFFLE(3,1,2,0))));
+}
+
+FIXED_KERNELS(avx2, AVX2, __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps,
+	avx2_zlo, avx2_zhi, avx2_even, avx2_odd, 2,
+	interleave_sse2_2, deinterleave_sse2_2)
+FIXED_KERNELS(avx2, AVX2, __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps,
+	avx2_zlo, avx2_zhi, avx2_even, avx2_odd, 4,
+	interleave_sse2_4, deinterleave_sse2_4)
+
+/*
+ * For 8 ports the three AVX2 zip rounds cost more than one 8x8 transpose,
+ * which with 8 ports also stores whole contiguous vectors.
+ */
+static AVX2 void
+interleave_avx2_8(float *dst, float **src, int nports, size_t first,
+	size_t nframes)
+{
+	__m256 r[8];
+	size_t f, n8 = nframes & ~(size_t)7;
+	int k;
+
+	for (f=0; f < n8; f += 8) {
+		for (k=0; k < 8; k++)
+			r[k] = _mm256_loadu_ps(src[k] + first + f);
+		transpose8(r);
+		for (k=0; k < 8; k++)
+			_mm256_storeu_ps(dst + (f+k)*8, r[k]);
+	}
+	interleave_sse2_8(dst + n8*8, src, 8, first + n8, nframes - n8);
+}
+
+static AVX2 void
+deinterleave_avx2_8(float **dst, const float *src, int nports, size_t first,
+	size_t nframes)
+{
+	__m256 r[8];
+	size_t f, n8 = nframes & ~(size_t)7;
+	int k;
+
+	for (f=0; f < n8; f += 8) {
+		for (k=0; k < 8; k++)
+			r[k] = _mm256_loadu_ps(src + (f+k)*8);
+		transpose8(r);
+		for (k=0; k < 8; k++)
+			_mm256_storeu_ps(dst[k] + first + f, r[k]);
+	}
+	deinterleave_sse2_8(dst, src + n8*8, 8, first + n8, nframes - n8);
+}
+
+/*
+ * AVX-512 has a two-source permute, so each zip or unzip is one instruction.
+ */
+#define AVX512	__attribute__((target("avx512f")))
+
+static inline AVX512 __m512
+avx512_zlo(__m512 a, __m512 b)
+{
+	return (_mm512_permutex2var_ps(a, _mm512_setr_epi32(0, 16, 1, 17,
+		2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23), b));
+}
+
+static inline AVX512 __m512
+avx512_zhi(__m512 a, __m512 b)
+{
+	return (_mm512_permutex2var_ps(a, _mm512_setr_epi32(8, 24, 9, 25,
+		10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31), b));
+}
+
+static inline AVX512 __m512
+avx512_even(__m512 a, __m512 b)
+{
+	return (_mm512_permutex2var_ps(a, _mm512_setr_epi32(0, 2, 4, 6,
+		8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30), b));
+}
+
+static inline AVX512 __m512
+avx512_odd(__m512 a, __m512 b)
+{
+	return (_mm512_permutex2var_ps(a, _mm512_setr_epi32(1, 3, 5, 7,
+		9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31), b));
+}
+
+FIXED_KERNELS(avx512, AVX512, __m512, 16, _mm512_loadu_ps, _mm512_storeu_ps,
+	avx512_zlo, avx512_zhi, avx512_even, avx512_odd, 2,
+	interleave_avx2_2, deinterleave_avx2_2)
+FIXED_KERNELS(avx512, AVX512, __m512, 16, _mm512_loadu_ps, _mm512_storeu_ps,
+	avx512_zlo, avx512_zhi, avx512_even, avx512_odd, 4,
+	interleave_avx2_4, deinterleave_avx2_4)
+FIXED_KERNELS(avx512, AVX512, __m512, 16, _mm512_loadu_ps, _mm512_storeu_ps,
+	avx512_zlo, avx512_zhi, avx512_even, avx512_odd, 8,
+	interleave_avx2_8, deinterleave_avx2_8)
+
+#endif /* HAVE_X86_SIMD */
+
+/*
+ * Kernel table.  fixed[level][k] handles exactly 1 << k ports; a missing
+ * entry means the generic kernel of that level is used.
+ */
+static const struct interleave_kernel fixed[IL_LEVELS][4] = {
+	[IL_SCALAR] = {
+		{ "copy", interleave_copy, deinterleave_copy },
+	},
+#ifdef HAVE_X86_SIMD
+	[IL_SSE2] = {
+		{ "copy", interleave_copy, deinterleave_copy },
+		{ "sse2/2", interleave_sse2_2, deinterleave_sse2_2 },
+		{ "sse2/4", interleave_sse2_4, deinterleave_sse2_4 },
+		{ "sse2/8", interleave_sse2_8, deinterleave_sse2_8 },
+	},
+	[IL_AVX2] = {
+		{ "copy", interleave_copy, deinterleave_copy },
+		{ "avx2/2", interleave_avx2_2, deinterleave_avx2_2 },
+		{ "avx2/4", interleave_avx2_4, deinterleave_avx2_4 },
+		{ "avx2/8", interleave_avx2_8, deinterleave_avx2_8 },
+	},
+	[IL_AVX512] = {
+		{ "copy", interleave_copy, deinterleave_copy },
+		{ "avx512/2", interleave_avx512_2, deinterleave_avx512_2 },
+		{ "avx512/4", interleave_avx512_4, deinterleave_avx512_4 },
+		{ "avx512/8", interleave_avx512_8, deinterleave_avx512_8 },
+	},
+#endif
+};
+
+static const struct interleave_kernel generic[IL_LEVELS] = {
+	[IL_SCALAR] = { "scalar", interleave_scalar, deinterleave_scalar },
+#ifdef HAVE_X86_SIMD
+	[IL_SSE2] = { "sse2", interleave_sse2, deinterleave_sse2 },
+	[IL_AVX2] = { "avx2", interleave_avx2, deinterleave_avx2 },
+	/* 8x8 AVX2 blocks are as wide as odd port counts usefully get */
+	[IL_AVX512] = { "avx2", interleave_avx2, deinterleave_avx2 },
+#endif
+};
+
+static const char *level_names[IL_LEVELS] = {
+	"scalar", "sse2", "avx2", "avx512"
+};
+
+/*
+ * Find out what this CPU can do.  Called once before jack is started.
+ */
+void
+interleave_init(void)
+{
+	cpu_level = IL_SCALAR;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		cpu_level = IL_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		cpu_level = IL_AVX2;
+	if (__builtin_cpu_supports("avx512f"))
+		cpu_level = IL_AVX512;
+#endif
+}
+
+int
+interleave_level(void)
+{
+	return (cpu_level);
+}
+
+const char *
+interleave_level_name(int level)
+{
+	return (level_names[level]);
+}
+
+/*
+ * Kernels for nports at a given level.  level must not be above
+ * interleave_level().
+ */
+const struct interleave_kernel *
+interleave_lookup(int level, int nports)
+{
+	int k;
+
+	while (level > IL_SCALAR && generic[level].interleave == NULL)
+		level--;
+	for (k=0; k < 4; k++) {
+		if (nports == 1 << k && fixed[level][k].interleave != NULL)
+			return (&fixed[level][k]);
+	}
+	return (&generic[level]);
+}
+
+const struct interleave_kernel *
+interleave_generic(int level)
+{
+	while (level > IL_SCALAR && generic[level].interleave == NULL)
+		level--;
+	return (&generic[level]);
+}
+
+/* Best kernels for nports on this CPU */
+const struct interleave_kernel *
+interleave_select(int nports)
+{
+	return (interleave_lookup(cpu_level, nports));
+}
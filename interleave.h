@@ -0,0 +1,49 @@
+/*
+ * interleave - move samples between JACK port buffers and interleaved frames
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef INTERLEAVE_H
+#define INTERLEAVE_H
+
+#include <stddef.h>
+
+/*
+ * Interleave frames [first, first+nframes) of nports port buffers into dst.
+ * dst receives nframes * nports samples: frame 0 port 0, frame 0 port 1, ...
+ */
+typedef void (*interleave_fn)(float *dst, float **src, int nports,
+	size_t first, size_t nframes);
+
+/*
+ * The reverse: nframes interleaved frames from src are stored into frames
+ * [first, first+nframes) of the port buffers.
+ */
+typedef void (*deinterleave_fn)(float **dst, const float *src, int nports,
+	size_t first, size_t nframes);
+
+/* CPU levels, in increasing order of capability */
+#define IL_SCALAR	0
+#define IL_SSE2		1
+#define IL_AVX2		2
+#define IL_AVX512	3
+#define IL_LEVELS	4
+
+struct interleave_kernel {
+	const char *name;
+	interleave_fn interleave;
+	deinterleave_fn deinterleave;
+};
+
+void interleave_init(void);
+int interleave_level(void);
+const char *interleave_level_name(int level);
+const struct interleave_kernel *interleave_select(int nports);
+const struct interleave_kernel *interleave_lookup(int level, int nports);
+const struct interleave_kernel *interleave_generic(int level);
+
+#endif /* INTERLEAVE_H */
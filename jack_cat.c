@@ -3,7 +3,7 @@
  *
  * The purpose of this program is to record and playback data from the JACK
  * audio connection kit.  It uses a single format data file: the 32 bit floats 
- * produced by jackd.
+ * produced by jackd, or with -f the same samples in less precision.
  *
  * Copyright 2016 Glen Overby
  * 
@@ -24,31 +24,89 @@
  * jack_cat
  *	-c filename	capture to file
  *	-p filename	play back from file
+ *	-V filename	check the CRCs of a chunked file, without jack
  *	-n count	number of ports (do not auto connect)
  *	-N name		client name to use with jack (default: jack_cat)
  *	-b size		block size to use
- *	-B size		ring buffer size
- *	-m size		maximum file size (for -C)
+ *	-B size		ring buffer size, or with an s suffix (-B 30s) enough
+ *			for that many seconds of all the ports
+ *	-w size		wake the disk thread when this much data (capture) or
+ *			space (playback) is in the ring buffer
+ *	-m size		maximum capture file size, rotating to numbered files
  *	-t time		run for time seconds
+ *	-q depth	io_uring queue depth (0: plain read/write)
+ *	-D		capture with O_DIRECT, bypassing the page cache
+ *	-W size		capture writeback window (0: leave it to the kernel)
+ *	-A size		capture file preallocation chunk (0: none)
+ *	-M		play back straight from a memory mapping of the file
+ *	-k size		capture to a chunked file with chunks of size
+ *	-s time		start playback time seconds into the file
+ *	-z threads	compress chunks losslessly with threads worker threads
+ *			(playback: decompress with them, -V: check with them)
+ *	-f format	capture sample format: float32, int16, int24, float16
+ *	-d		dither int16 captures
+ *	-S level	record runs of samples at or below level as silence
+ *	-L		lock all memory (mlockall), the jack callback's included
  *
  *	port1 .. portn	names of ports to connect to
  *
- * The file starts with:
- *	JACK#\0
- * where # is replaced by the count of streams written to the file.
+ * The file starts with a header (see format.c) recording the count of
+ * streams, the sample format and rate, the jack period, when the capture
+ * started, and the port names, padded to 4 KiB.  The start time and sample
+ * rate are filled in when the file is closed.  Files from older versions,
+ * which start with "JACK#\0" (# the count of streams), can still be played.
  * Stream data is interleaved.  That seems like the most universal way to
  * represent the data so that it can be played back when jackd is running with
- * a different jack period size.
+ * a different jack period size.  A capture replaces an existing file.
+ *
+ * With -m, capture goes to numbered files filename.0000, filename.0001, ...
+ * each with its own header and holding whole frames, starting after the
+ * highest number that already exists.  The next file is opened ahead of time
+ * by a helper thread, which also closes the full ones.
+ *
+ * With -z the chunks (-k, or ZCHUNK bytes) are compressed by a pool of
+ * worker threads (workers.c) with the lossless float codec in codec.c, each
+ * on its own, and written in order by the disk thread.  Playback decodes
+ * them the same way, several chunks ahead of the ringbuffer.
+ *
+ * With -S, spans of at least SILENCE_FRAMES quiet frames are found with a
+ * SIMD scan (silence.c) as the disk thread takes them from the ringbuffer,
+ * and are stored as a chunk with no payload that only counts the frames.
+ * Playback puts zeros in the ringbuffer for those without reading anything.
+ *
+ * Frames the callback has no room for in the ringbuffer, or cycles jack
+ * skips (an xrun), leave a gap in the capture.  A chunked file
+ * records each one where it happened as a silent chunk flagged CHUNK_GAP,
+ * so playback keeps the timing; a flat file lists them in filename.gaps.
+ *
+ * Every chunk carries a CRC-32C of its header and payload (crc32c.c, in
+ * hardware where the CPU has it), made by the disk thread as it writes the
+ * chunk.  Playback checks it and counts chunks that do not match, and -V
+ * checks a whole file, a range of chunks to each of several threads.
+ *
+ * With -f the samples are stored in less precision (convert.c), converted
+ * by the disk thread as it copies them out of the ringbuffer, and back to
+ * floats when they are read for playback.  The jack side does not change.
  *
  * Program Outline:
  *	For capture, 
  *		jack_capture_callback reads data from JACK and write it to
- *		a jack ringbuffer.
+ *		the ring buffer (ring.c), interleaving a whole period at a time with
+ *		the kernels in interleave.c.
  *
  *		disk_write writes data in the buffer to disk.
  *	For playback:
+ *		disk_read reads data from disk into the ring buffer.
+ *
+ *		jack_playback_callback de-interleaves a whole period from the
+ *		ringbuffer into the port buffers.
+ *
+ *		With -M there is no ringbuffer: the file is mapped, disk_read
+ *		faults in (and locks) the pages ahead of the play position, and
+ *		jack_playback_callback de-interleaves from the mapping.
  */
 
+#define _GNU_SOURCE		/* O_DIRECT */
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -56,21 +114,40 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <jack/jack.h>
 #include <jack/types.h>
 #include <jack/session.h>
-#include <jack/ringbuffer.h>
 #include <pthread.h>
+#include "interleave.h"
+#include "wakeup.h"
+#include "uring.h"
+#include "format.h"
+#include "codec.h"
+#include "workers.h"
+#include "convert.h"
+#include "silence.h"
+#include "crc32c.h"
+#include "ring.h"
 
 #define MAX_PORTS	32	/* maximum number of ports (artificial limit) */
 #define MAX_NAME	32	/* character string sizes */
 
-#define FILE_HEADER_LEN	6	/* length of file header: "JACK00" */
+#define DIRECT_ALIGN	4096	/* O_DIRECT buffer, size and offset alignment */
+#define RA_SECONDS	1	/* playback readahead window, seconds of data */
+#define RA_MAX_SECONDS	8	/* ... and how far it can grow */
+#define ZCHUNK		262144	/* -z and -S chunk size, without -k */
+#define SILENCE_FRAMES	1024	/* shortest span of silence -S elides */
+#define SILENCE_MAX	(1 << 30)	/* longest span in one record */
 
 #define	CFG_CAPTURE	1
 #define CFG_PLAYBACK	2
+#define CFG_VERIFY	3
 struct config {
 	char *filename;		/* filename for read or write */
 	int io;			/* input(1) or output(2) */
@@ -79,15 +156,62 @@ struct config {
 	char *jackname;		/* name of client for jack */
 	char *portbase;		/* base name of jack ports */
 	char **connect;		/* ports to connect to */
-	int blocksize;		/* I/O block size */
-	int rbsize;		/* jack ringbuffer size */
+	long blocksize;		/* I/O block size */
+	long rbsize;		/* ring buffer size */
+	float rbseconds;	/* -B in seconds: rbsize from the sample rate */
+	long wakeup;		/* ringbuffer level that wakes disk thread */
+	int qdepth;		/* io_uring queue depth, 0 for none */
+	int direct;		/* capture with O_DIRECT */
+	long wbwindow;		/* capture writeback/drop-behind window */
+	long prealloc;		/* capture file preallocation chunk */
+	long maxsize;		/* capture file size limit, 0 for none */
+	int mmap;		/* play back from a mapping of the file */
+	int lockall;		/* -L: mlockall */
+	int rate;		/* jack sample rate, once it is known */
+	int period;		/* jack period, once it is known */
+	int chunk;		/* chunk size for chunked capture, 0 for none */
+	int start;		/* where to start playback, seconds */
+	int format;		/* capture sample format, FORMAT_* */
+	int dither;		/* dither int16 captures */
+	int elide;		/* -S: do not store silence */
+	float level;		/* ... which is at or below this */
+	int compress;		/* -z: compress chunks */
+	int zthreads;		/* ... with this many worker threads */
+	int fd;			/* playback file */
+	struct file_header header;	/* of the playback file, or the
+					   capture file template */
+	struct chunk_index index;	/* of a chunked playback file */
+	size_t chunk_first;	/* chunk to start playback at */
+	size_t chunk_skip;	/* bytes of it to skip */
 	int runtime;		/* how long to run for */
 };
 
 struct status {
 	int	jack_calls;
 	int	disk_io;
+	int	disk_wakeups;	/* times disk thread was woken */
+	int	disk_wrapped;	/* writes across the end of the ring (capture) */
+	int	disk_inflight;	/* io_uring requests in flight */
+	int	uring;		/* disk thread is using io_uring */
+	long	uring_latency;	/* average io_uring request time, us */
+	long	uring_latency_max;	/* longest io_uring request, us */
+	long	wb_latency;	/* average wait for window writeback, us */
+	long	wb_latency_max;	/* longest wait for window writeback, us */
 	long	disk_bytes;
+	long	ra_window;	/* playback readahead window, bytes */
+	int	files;		/* capture files rotated to */
+	int	rotate_waits;	/* rotations that waited for the next file */
+	long	raw_bytes;	/* -z: frames before encoding, and */
+	long	coded_bytes;	/* ... the payload they took in the file */
+	long	codec_us;	/* average chunk encode/decode time, us */
+	long	codec_us_max;	/* longest chunk encode/decode, us */
+	long	silent_bytes;	/* silence not written, or not read */
+	long	crc_chunks;	/* chunks whose CRC playback checked */
+	int	crc_errors;	/* ... and that did not match */
+	int	xruns;		/* reported by jack */
+	int	gaps;		/* gaps recorded (capture) or played */
+	long	gap_frames;	/* ... and the frames they take */
+	int	gaps_lost;	/* gaps the queue had no room for */
 	int	overflows;	/* times ringbuffer was full (capture) */
 	int	underruns;	/* times ringbuffer was empty (playback */
 	int	stop;		/* terminate program */
@@ -105,23 +229,89 @@ struct callbackdata {
 	struct config *cfg;
 	jack_default_audio_sample_t *buf[MAX_PORTS];	/* Buffers for each port */
 	jack_port_t *ports[MAX_PORTS];	/* Jack ports */
+	const struct interleave_kernel *kernel;	/* (de)interleave for ports */
 	int ready;		/* initialization complete */
 };
 
+/*
+ * Playback straight from a mapping of the file (-M).
+ *
+ * The disk thread makes [0, ready) of the data resident before publishing
+ * it, and the callback never reads past ready, so it does not take a page
+ * fault for a page that has to come from disk.  pos is how far the callback
+ * has played; the disk thread stays up to rbsize ahead of it and unlocks
+ * and drops the pages behind it.  Offsets are from the first frame.
+ */
+#define PLAYMAP_ACTIVE	1
+struct playmap {
+	int state;		/* PLAYMAP_ACTIVE once the file is mapped */
+	char *map;		/* the whole file */
+	size_t maplen;
+	const char *data;	/* first frame */
+	size_t len;		/* bytes of whole frames */
+	size_t ready;		/* resident up to here (disk thread) */
+	size_t pos;		/* played up to here (callback) */
+};
+
+/* When the capture started, for the file headers */
+struct capture_start {
+	int known;
+	uint64_t frame;		/* jack frame time */
+	uint64_t ns;		/* wall clock */
+};
+
+/*
+ * Gaps in the capture: frames of a period the callback had no room for in
+ * the ringbuffer, and cycles jack skipped (xruns), which show up as a
+ * jump in the frame time.  The callback adds up lost frames that follow
+ * one another into one gap, and queues it for the disk thread just before
+ * the next frames go in the ringbuffer.  The disk thread puts them in a
+ * chunked file as gap chunks, which are played back as silence, or lists
+ * them in a .gaps file next to a flat one.
+ */
+#define GAP_QUEUE	256	/* gaps queued for the disk thread */
+#define GAP_OVERFLOW	1	/* kind: frames dropped, ringbuffer full */
+#define GAP_XRUN	2	/* ... cycles jack did not run */
+
+struct gap {
+	uint64_t at;		/* frames captured before it */
+	uint64_t time;		/* jack frame time it starts at */
+	uint32_t frames;
+	int kind;		/* GAP_OVERFLOW and/or GAP_XRUN */
+};
+
+struct gaps {
+	struct gap q[GAP_QUEUE];
+	unsigned int head;	/* next to take (disk thread) */
+	unsigned int tail;	/* next to fill (callback) */
+	uint64_t captured;	/* frames put in the ringbuffer */
+	jack_nframes_t next;	/* frame time of the next period */
+	int started;
+	struct gap open;	/* being added up by the callback */
+	int isopen;
+	FILE *log;		/* .gaps file of a flat capture */
+	int nolog;		/* it could not be opened */
+};
+
 struct status status;		/* Global status */
-jack_ringbuffer_t *buffer;	/* Jack-to-disk ring buffer */
+struct ring *buffer;		/* Jack-to-disk ring buffer */
 pthread_t disk_thread;		/* pthread for disk reader/writer */
-pthread_cond_t disk_cond;	/* for synchronizing disk and jack */
-pthread_mutex_t disk_mutex;	/* mutex protecting disk_cond */
+struct wakeup disk_wakeup;	/* jack callback wakes disk thread */
+struct playmap playmap;		/* -M file mapping */
+struct capture_start capture_start;	/* first captured period */
+struct gaps gaps;		/* callback to disk thread */
 jack_client_t *jclient;		/* Jack client */
 
 int parse_args(int argc, char **argv, struct config *c);
+void ring_size(struct config *c);
 void set_signal_handler();
 void start_io(struct config *c);
 void stop_io(struct config *c);
 void usage();
 void help();
+int open_jack(struct config *c);
 int setup_jack(struct config *c);
+int verify_file(struct config *c);
 void cleanup_jack();
 
 int
@@ -134,18 +324,65 @@ main(int argc, char **argv)
 	memset((void*)&config, 0, sizeof(struct config));
 	config.rbsize = 1048576;
 	config.blocksize = 1048576;
+	config.qdepth = 4;
+	config.wbwindow = 8388608;
+	config.prealloc = 268435456;
+	config.format = FORMAT_FLOAT32;
 
 	if (parse_args(argc, argv, &config) != 0)
 		exit(1);
 
 	set_signal_handler();
 
-	buffer = jack_ringbuffer_create(config.rbsize);
-	/* touch all allocated space to allocate pages */
-	memset(buffer->buf, 0, buffer->size);
+	interleave_init();
+	crc32c_init();
+
+	if (config.io == CFG_VERIFY)
+		exit(verify_file(&config) == 0 ? 0 : 1);
+
+	/* the sample rate is needed to size the ring for -B seconds */
+	if (open_jack(&config) != 0)
+		exit(1);
+	ring_size(&config);
+
+	buffer = ring_create(config.rbsize);
+	if (buffer == NULL) {
+		fprintf(stderr, "cannot allocate a %ld byte ring buffer\n",
+			config.rbsize);
+		exit(1);
+	}
+	/*
+	 * Fault in all the pages up front, then keep them.  -M plays from the
+	 * file mapping, and the ring is only touched if the file cannot be
+	 * mapped, so it is left unbacked rather than filled and locked.
+	 */
+	if (!config.mmap) {
+		ring_prefault(buffer);
+		ring_lock(buffer);
+	}
+	printf("ring buffer %zu KB, %zu KB pages%s%s\n", buffer->size / 1024,
+		buffer->page / 1024,
+		buffer->huge == RING_THP ? " (transparent huge pages asked for)" :
+		"", buffer->locked ? ", locked" : "");
+
+	/*
+	 * With -L everything is locked, including what is still to come: the
+	 * callback data, and the stack of the thread jack runs the callback
+	 * on, which it starts when setup_jack activates the client.
+	 */
+	if (config.lockall && mlockall(MCL_CURRENT|MCL_FUTURE) == -1)
+		fprintf(stderr, "mlockall: %s (ulimit -l?)\n", strerror(errno));
 
-	pthread_cond_init(&disk_cond, NULL);
-	pthread_mutex_init(&disk_mutex, NULL);
+	/*
+	 * The disk thread is woken when a wakeup threshold worth of data (or
+	 * space) is in the ring.  It has to be well below the ring size or
+	 * the callback would run out of room before the disk thread is woken.
+	 */
+	if (config.wakeup <= 0)
+		config.wakeup = config.blocksize;
+	if (config.wakeup > buffer->size / 2)
+		config.wakeup = buffer->size / 2;
+	wakeup_init(&disk_wakeup);
 
 	start_io(&config);
 
@@ -158,16 +395,54 @@ main(int argc, char **argv)
 	while(status.stop == 0) {
 		sleep(1);
 		printf("jack calls  %d\n", status.jack_calls);
-		printf("disk i/o calls %d bytes %ld\n", status.disk_io,
-			status.disk_bytes);
+		printf("disk i/o calls %d bytes %ld wakeups %d\n",
+			status.disk_io, status.disk_bytes, status.disk_wakeups);
+		if (config.io == CFG_CAPTURE)
+			printf("writes across the ring wrap %d\n",
+				status.disk_wrapped);
+		if (status.uring)
+			printf("io_uring in flight %d of %d latency %ld us max %ld us\n",
+				status.disk_inflight, config.qdepth,
+				status.uring_latency, status.uring_latency_max);
+		if (config.io == CFG_CAPTURE && config.wbwindow > 0 &&
+		    !config.direct)
+			printf("writeback latency %ld us max %ld us\n",
+				status.wb_latency, status.wb_latency_max);
+		if (config.io == CFG_PLAYBACK && status.ra_window > 0)
+			printf("readahead window %ld KB\n",
+				status.ra_window / 1024);
+		if (config.io == CFG_CAPTURE && config.maxsize > 0)
+			printf("file rotations %d waited %d\n",
+				status.files, status.rotate_waits);
+		if (status.silent_bytes > 0)
+			printf("silence %ld KB not %s\n",
+				status.silent_bytes / 1024,
+				config.io == CFG_CAPTURE ? "written" : "read");
+		if (status.crc_chunks > 0)
+			printf("crc checked %ld chunks errors %d\n",
+				status.crc_chunks, status.crc_errors);
+		if (status.gaps > 0 || status.xruns > 0)
+			printf("gaps %d frames %ld lost %d xruns %d\n",
+				status.gaps, status.gap_frames,
+				status.gaps_lost, status.xruns);
+		if (status.coded_bytes > 0)
+			printf("compression %ld KB to %ld KB (%.2f) %s %ld us max %ld us\n",
+				status.raw_bytes / 1024,
+				status.coded_bytes / 1024,
+				(double)status.raw_bytes / status.coded_bytes,
+				config.io == CFG_CAPTURE ? "encode" : "decode",
+				status.codec_us, status.codec_us_max);
 		printf("overflows %d underruns %d\n", status.overflows,
 			status.underruns);
 	}
 
 	printf("main() stopping\n");
 	printf("jack calls  %d\n", status.jack_calls);
-	printf("disk i/o calls %d bytes %ld\n", status.disk_io,
-		status.disk_bytes);
+	printf("disk i/o calls %d bytes %ld wakeups %d\n",
+		status.disk_io, status.disk_bytes, status.disk_wakeups);
+	if (config.io == CFG_CAPTURE)
+		printf("writes across the ring wrap %d\n",
+			status.disk_wrapped);
 	printf("overflows %d underruns %d\n", status.overflows,
 		status.underruns);
 
@@ -175,61 +450,162 @@ main(int argc, char **argv)
 
 	// pthread join disk thread
 	stop_io(&config);
+	if (status.silent_bytes > 0)
+		printf("silence %ld KB not %s\n", status.silent_bytes / 1024,
+			config.io == CFG_CAPTURE ? "written" : "read");
+	if (status.crc_chunks > 0)
+		printf("crc checked %ld chunks errors %d\n", status.crc_chunks,
+			status.crc_errors);
+	if (status.gaps > 0 || status.xruns > 0)
+		printf("gaps %d frames %ld lost %d xruns %d\n", status.gaps,
+			status.gap_frames, status.gaps_lost, status.xruns);
+	if (status.coded_bytes > 0)
+		printf("compression %ld KB to %ld KB (%.2f) %s %ld us max %ld us\n",
+			status.raw_bytes / 1024, status.coded_bytes / 1024,
+			(double)status.raw_bytes / status.coded_bytes,
+			config.io == CFG_CAPTURE ? "encode" : "decode",
+			status.codec_us, status.codec_us_max);
 }
 
-int
+long
 units(char u)
 {
-	int	multiplier = 1;
+	long	multiplier = 1;
 
 	switch(u) {
-	case 'k':	multiplier = 1024;		break;
-	case 'm':	multiplier = 1048576;		break;
-	case 'g':	multiplier = 1073741824;	break;
+	case 'k':	multiplier = 1024L;		break;
+	case 'm':	multiplier = 1048576L;		break;
+	case 'g':	multiplier = 1073741824L;	break;
+	case 't':	multiplier = 1099511627776L;	break;
 	default:	multiplier = -1;		break;
 	}
 	return (multiplier);
 }
 
+/*
+ * Parse the size argument of option opt, a count of bytes with optional
+ * units, into *size.  Returns -1, having said why, if it is not one.
+ */
+static int
+size_arg(int opt, char *arg, long *size)
+{
+	long m;
+	char u;
+	int r;
+
+	r = sscanf(arg, "%li%c", size, &u);
+	if (r < 1 || *size < 0) {
+		fprintf(stderr, "-%c size was invalid\n", opt);
+		return (-1);
+	}
+	if (r > 1) {
+		if ((m = units(u)) == -1) {
+			fprintf(stderr, "-%c units was invalid\n", opt);
+			return (-1);
+		}
+		if (*size > LONG_MAX / m) {
+			fprintf(stderr, "-%c size is too large\n", opt);
+			return (-1);
+		}
+		*size *= m;
+	}
+	return (0);
+}
+
+/*
+ * Parse the count argument of option opt, a number from min to max, into
+ * *n.  Returns -1, having said why, if it is not one.
+ */
+static int
+count_arg(int opt, char *arg, int min, int max, int *n)
+{
+	char u;
+
+	if (sscanf(arg, "%i%c", n, &u) != 1 || *n < min || *n > max) {
+		if (max == INT_MAX)
+			fprintf(stderr, "-%c takes a number, %d or more\n",
+				opt, min);
+		else
+			fprintf(stderr, "-%c takes a number from %d to %d\n",
+				opt, min, max);
+		usage();
+		return (-1);
+	}
+	return (0);
+}
+
 int
 parse_args(int argc, char **argv, struct config *c)
 {
 	int opt;		/* option returned from getopt */
-	int r;			/* local return from function calls */
-	int m;			/* multiplier */
+	long l;			/* size argument */
 	char u;			/* units portion of numbers */
 
-	while ((opt = getopt(argc, argv, "+b:B:c:C:hj:n:N:p:P:t:")) != -1) {
+	while ((opt = getopt(argc, argv, "+A:b:B:c:C:dDf:hj:k:Lm:Mn:N:p:P:q:s:S:t:V:w:W:z:")) != -1) {
 		switch(opt) {
+		case 'A':
+			if (size_arg(opt, optarg, &c->prealloc) == -1)
+				return(1);
+			break;
 		case 'b':
-			r = sscanf(optarg, "%i%c", &c->blocksize, &u);
-			if (r > 1) {
-				if ((m = units(u)) == -1) {
-					fprintf(stderr, "-b units was invalid\n");
-					break;
-				}
-				c->blocksize *= m;
-			}
+			if (size_arg(opt, optarg, &c->blocksize) == -1)
+				return(1);
 			break;
 		case 'B':
-			r = sscanf(optarg, "%i%c", &c->rbsize, &u);
-			if (r > 1) {
-				if ((m = units(u)) == -1) {
-					fprintf(stderr, "-B units was invalid\n");
-					break;
+			/* seconds of audio, sized once the rate is known */
+			if (sscanf(optarg, "%f%c", &c->rbseconds, &u) == 2 &&
+			    u == 's') {
+				if (c->rbseconds <= 0) {
+					fprintf(stderr, "-B seconds must be more than 0\n");
+					return(1);
 				}
-				c->rbsize *= m;
+				break;
 			}
+			c->rbseconds = 0;
+			if (size_arg(opt, optarg, &c->rbsize) == -1)
+				return(1);
 			break;
 		case 'c':
 			c->filename = strdup(optarg);
 			c->io = CFG_CAPTURE;
 			break;
+		case 'd':
+			c->dither = 1;
+			break;
+		case 'D':
+			c->direct = 1;
+			break;
+		case 'f':
+			if ((c->format = header_format(optarg)) == -1) {
+				fprintf(stderr, "-f format is one of float32, int16, int24, float16\n");
+				return(1);
+			}
+			break;
 		case 'j':
 			c->jackname = strdup(optarg);
 			break;
+		case 'k':
+			if (size_arg(opt, optarg, &l) == -1)
+				return(1);
+			if (l > INT_MAX) {
+				fprintf(stderr, "-k chunks are at most 2 GB\n");
+				return(1);
+			}
+			c->chunk = l;
+			break;
+		case 'm':
+			if (size_arg(opt, optarg, &c->maxsize) == -1)
+				return(1);
+			break;
+		case 'L':
+			c->lockall = 1;
+			break;
+		case 'M':
+			c->mmap = 1;
+			break;
 		case 'n':
-			r = sscanf(optarg, "%i", &c->ports); /* no units */
+			if (count_arg(opt, optarg, 1, MAX_PORTS, &c->ports) == -1)
+				return(1);
 			break;
 		case 'N':
 			c->portbase = strdup(optarg);
@@ -238,8 +614,41 @@ parse_args(int argc, char **argv, struct config *c)
 			c->filename = strdup(optarg);
 			c->io = CFG_PLAYBACK;
 			break;
+		case 'q':
+			if (count_arg(opt, optarg, 0, INT_MAX, &c->qdepth) == -1)
+				return(1);
+			break;
+		case 's':
+			if (count_arg(opt, optarg, 0, INT_MAX, &c->start) == -1)
+				return(1);
+			break;
+		case 'S':
+			if (sscanf(optarg, "%f", &c->level) != 1 || c->level < 0) {
+				fprintf(stderr, "-S level is a sample value, 0 or more\n");
+				return(1);
+			}
+			c->elide = 1;
+			break;
 		case 't':
-			r = sscanf(optarg, "%i", &c->runtime); /* no units */
+			if (count_arg(opt, optarg, 0, INT_MAX, &c->runtime) == -1)
+				return(1);
+			break;
+		case 'V':
+			c->filename = strdup(optarg);
+			c->io = CFG_VERIFY;
+			break;
+		case 'w':
+			if (size_arg(opt, optarg, &c->wakeup) == -1)
+				return(1);
+			break;
+		case 'W':
+			if (size_arg(opt, optarg, &c->wbwindow) == -1)
+				return(1);
+			break;
+		case 'z':
+			if (count_arg(opt, optarg, 0, INT_MAX, &c->zthreads) == -1)
+				return(1);
+			c->compress = 1;
 			break;
 		case 'h':
 			help();
@@ -253,7 +662,7 @@ parse_args(int argc, char **argv, struct config *c)
 		printf("%d port names\n", argc-optind);
 		c->connect = &argv[optind];
 		c->ports = argc-optind;
-	} else if (c->ports == 0) {
+	} else if (c->ports == 0 && c->io != CFG_VERIFY) {
 		fprintf(stderr, "Either a count of ports (-n) or a list of ports to connect to is required\n");
 		return(1);
 	}
@@ -262,28 +671,149 @@ parse_args(int argc, char **argv, struct config *c)
 	 * Required argument checks
 	 */
 	if (c->io == 0) {
-		fprintf(stderr, "-c or -p is required\n");
+		fprintf(stderr, "-c, -p or -V is required\n");
 		return(1);
 	}
 	if (c->filename == NULL) {
-		fprintf(stderr, "-[cp] filename is required\n");
+		fprintf(stderr, "-[cpV] filename is required\n");
+		return(1);
+	}
+	if (c->io == CFG_CAPTURE && c->compress &&
+	    c->format != FORMAT_FLOAT32) {
+		fprintf(stderr, "-z only compresses float32 samples\n");
+		return(1);
+	}
+	if (c->dither && c->format != FORMAT_INT16) {
+		fprintf(stderr, "-d is only for -f int16\n");
+		return(1);
+	}
+	if (c->ports > MAX_PORTS) {
+		fprintf(stderr, "at most %d ports\n", MAX_PORTS);
+		return(1);
+	}
+	if (c->io == CFG_CAPTURE && c->maxsize > 0 && c->maxsize <
+	    FORMAT_ALIGN + c->ports * (long)header_sample_size(c->format)) {
+		fprintf(stderr, "-m must hold the %d byte header and a frame\n",
+			FORMAT_ALIGN);
+		return(1);
+	}
+	if (c->mmap && c->io != CFG_PLAYBACK) {
+		fprintf(stderr, "-M is only for playback (-p)\n");
+		return(1);
+	}
+	if (c->mmap && c->lockall) {
+		/* it would lock the whole file mapping in at once */
+		fprintf(stderr, "-L and -M cannot be used together\n");
 		return(1);
 	}
 	return(0);
 }
 
+/*
+ * With -B seconds, size the ring to hold that long of all the ports at the
+ * jack sample rate.  Either way, warn when the ring takes more memory than
+ * makes sense: over half of RAM, or over what is free now.
+ */
+void
+ring_size(struct config *c)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	long ram = sysconf(_SC_PHYS_PAGES) * page;
+	long avail = sysconf(_SC_AVPHYS_PAGES) * page;
+
+	if (c->rbseconds > 0) {
+		c->rbsize = (double)c->rbseconds * c->rate * c->ports *
+			sizeof(jack_default_audio_sample_t);
+		printf("ring buffer %ld KB: %.1f seconds of %d ports at %d Hz\n",
+			c->rbsize / 1024, c->rbseconds, c->ports, c->rate);
+	}
+	if (ram > 0 && c->rbsize > ram / 2)
+		fprintf(stderr, "warning: the %ld MB ring buffer is over half of the %ld MB of RAM\n",
+			c->rbsize / 1048576, ram / 1048576);
+	else if (avail > 0 && c->rbsize > avail)
+		fprintf(stderr, "warning: the %ld MB ring buffer is more than the %ld MB of free memory\n",
+			c->rbsize / 1048576, avail / 1048576);
+}
+
+/* Queue the open gap for the disk thread (callback) */
+static void
+gap_push(void)
+{
+	gaps.isopen = 0;
+	if (gaps.tail - __atomic_load_n(&gaps.head, __ATOMIC_ACQUIRE) ==
+	    GAP_QUEUE) {
+		status.gaps_lost++;
+		return;
+	}
+	gaps.q[gaps.tail % GAP_QUEUE] = gaps.open;
+	__atomic_store_n(&gaps.tail, gaps.tail + 1, __ATOMIC_RELEASE);
+}
+
+/* frames lost from jack frame time time on (callback) */
+static void
+gap_add(uint64_t time, uint32_t frames, int kind)
+{
+	struct gap *o = &gaps.open;
+
+	if (gaps.isopen && o->time + o->frames == time) {
+		o->frames += frames;
+		o->kind |= kind;
+		return;
+	}
+	if (gaps.isopen)
+		gap_push();
+	o->at = gaps.captured;
+	o->time = time;
+	o->frames = frames;
+	o->kind = kind;
+	gaps.isopen = 1;
+}
+
+/* The oldest gap not taken yet, or NULL (disk thread) */
+static struct gap *
+gap_peek(void)
+{
+	if (gaps.head == __atomic_load_n(&gaps.tail, __ATOMIC_ACQUIRE))
+		return (NULL);
+	return (&gaps.q[gaps.head % GAP_QUEUE]);
+}
+
+/* Done with the gap from gap_peek */
+static void
+gap_pop(void)
+{
+	status.gaps++;
+	status.gap_frames += gaps.q[gaps.head % GAP_QUEUE].frames;
+	__atomic_store_n(&gaps.head, gaps.head + 1, __ATOMIC_RELEASE);
+}
+
+/* JACK xrun callback: the cycles lost show in the next period's frame time */
+int
+jack_xrun_callback(void *arg)
+{
+	status.xruns++;
+	return (0);
+}
+
 /* JACK Callback for capture
  *
  * Callback returns 0 for normal operation.  Non-zero shuts it down as a jack
- * client.
+ * client.  When the whole period does not fit in the ring buffer, the
+ * whole frames that do are written and the rest are a gap, as are cycles
+ * jack skipped.
  */
 int
 jack_capture_callback(jack_nframes_t nframes, void *arg)
 {
-	int f, i;
+	int i;
 	size_t space;			/* space in ring buffer */
+	size_t need;			/* bytes in this period */
+	size_t framesize;		/* bytes in a frame */
+	jack_nframes_t fit;		/* frames there is room for */
+	char *p;			/* ring buffer free space */
 	struct callbackdata *cbd;	/* data for use here */
 	int nports;			/* number of ports */
+	jack_nframes_t now;		/* frame time of this period */
 
 	status.jack_calls++;
 
@@ -293,42 +823,117 @@ jack_capture_callback(jack_nframes_t nframes, void *arg)
 		return(0);
 	}
 
+	now = jack_last_frame_time(jclient);
+	if (!capture_start.known) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		capture_start.frame = now;
+		capture_start.ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		__atomic_store_n(&capture_start.known, 1, __ATOMIC_RELEASE);
+	}
+	if (gaps.started && now != gaps.next)
+		gap_add(gaps.next, now - gaps.next, GAP_XRUN);
+	gaps.started = 1;
+	gaps.next = now + nframes;
+
 	nports = cbd->cfg->ports;
+	framesize = sizeof(jack_default_audio_sample_t) * nports;
+	need = nframes * framesize;
 
 	/* Is there enough space in the ring buffer for all data in all the
-	 * ports?  */
-	space = jack_ringbuffer_write_space(buffer);
-	if (space < nframes * sizeof(jack_default_audio_sample_t) * nports) {
+	 * ports?  If not, keep the frames at the start that fit.  */
+	space = ring_reserve(buffer, need, &p);
+	fit = nframes;
+	if (space < need) {
 		status.overflows++;
-		// signal disk thread?
+		fit = space / framesize;
+	}
+	if (fit > 0) {
+		/* get buffers for each port */
+		for (i=0; i < nports; i++) {
+			cbd->buf[i] = jack_port_get_buffer(cbd->ports[i],
+				nframes);
+		}
+		if (gaps.isopen)
+			gap_push();
+
+		/* Interleave the period straight into the ring buffer */
+		cbd->kernel->interleave((float *)p, cbd->buf, nports, 0, fit);
+		ring_commit(buffer, fit * framesize);
+		gaps.captured += fit;
+	}
+	if (fit < nframes) {
+		gap_add(now + fit, nframes - fit, GAP_OVERFLOW);
+		wakeup_post(&disk_wakeup);
 		return(0);
 	}
-	/* get buffers for each port */
+
+	/* Wake the disk thread once a worthwhile block is ready */
+	if (ring_fill(buffer) >= cbd->cfg->wakeup)
+		wakeup_post(&disk_wakeup);
+	return(0);
+}
+
+/*
+ * jack_playback_callback for -M: de-interleave straight from the file
+ * mapping, never past what the disk thread has made resident.
+ */
+static int
+playmap_callback(struct callbackdata *cbd, jack_nframes_t nframes)
+{
+	struct playmap *pm = &playmap;
+	size_t framesize, need, ready, have, f;
+	int i, nports;
+
+	nports = cbd->cfg->ports;
+	framesize = nports * sizeof(jack_default_audio_sample_t);
+	need = nframes * framesize;
+	ready = __atomic_load_n(&pm->ready, __ATOMIC_ACQUIRE);
+	have = ready - pm->pos;
+
 	for (i=0; i < nports; i++) {
 		cbd->buf[i] = jack_port_get_buffer(cbd->ports[i], nframes);
 	}
 
-	/* Write data to ring buffer one sample at a time, interleaving ports */
-	for (f=0; f < nframes; f++) {
+	if (have < need && ready < pm->len) {
+		status.underruns++;
 		for (i=0; i < nports; i++) {
-			jack_ringbuffer_write(buffer, (char *)cbd->buf[i]++,
-				sizeof(jack_default_audio_sample_t));
+			memset((char *)cbd->buf[i], 0,
+				sizeof(jack_default_audio_sample_t)*nframes);
 		}
+		wakeup_post(&disk_wakeup);
+		return(0);
 	}
 
-	/* Signal disk thread that data is available */
-	if(pthread_mutex_trylock(&disk_mutex) == 0) {
-		pthread_cond_signal(&disk_cond);
-		pthread_mutex_unlock(&disk_mutex);
+	/* at the end of the file, play what is left and pad with silence */
+	f = have < need ? have / framesize : nframes;
+	cbd->kernel->deinterleave(cbd->buf, (const float *)(pm->data + pm->pos),
+		nports, 0, f);
+	if (f < nframes) {
+		for (i=0; i < nports; i++) {
+			memset((char *)(cbd->buf[i] + f), 0,
+				sizeof(jack_default_audio_sample_t)*(nframes-f));
+		}
+		status.eof = 1;
+		status.stop = 1;
+		jack_deactivate(jclient);
 	}
+	__atomic_store_n(&pm->pos, pm->pos + f * framesize, __ATOMIC_RELEASE);
+
+	/* Wake the disk thread once it can get a worthwhile block ahead */
+	if (cbd->cfg->rbsize - (ready - pm->pos) >= cbd->cfg->wakeup)
+		wakeup_post(&disk_wakeup);
 	return(0);
 }
 
 int
 jack_playback_callback(jack_nframes_t nframes, void *arg)
 {
-	int f, i;
+	int i;
 	size_t space;			/* space in ring buffer */
+	size_t need;			/* bytes in this period */
+	char *p;			/* ring buffer data */
 	struct callbackdata *cbd;	/* data for use here */
 	int nports;			/* number of ports */
 
@@ -340,8 +945,11 @@ jack_playback_callback(jack_nframes_t nframes, void *arg)
 	if (cbd->ready == 0) {
 		return(0);
 	}
+	if (__atomic_load_n(&playmap.state, __ATOMIC_ACQUIRE) == PLAYMAP_ACTIVE)
+		return (playmap_callback(cbd, nframes));
 
 	nports = cbd->cfg->ports;
+	need = nframes * sizeof(jack_default_audio_sample_t) * nports;
 
 	/* get buffers for each port */
 	for (i=0; i < nports; i++) {
@@ -351,8 +959,8 @@ jack_playback_callback(jack_nframes_t nframes, void *arg)
 	/* Is there enough data in the ring buffer for all data in all the
 	 * ports?
 	 */
-	space = jack_ringbuffer_read_space(buffer);
-	if (space < nframes * sizeof(jack_default_audio_sample_t) * nports) {
+	space = ring_peek(buffer, need, &p);
+	if (space < need) {
 		status.underruns++;
 		for (i=0; i < nports; i++) {
 			memset((char *)cbd->buf[i], 0,
@@ -362,21 +970,41 @@ jack_playback_callback(jack_nframes_t nframes, void *arg)
 			status.stop = 1;
 			jack_deactivate(jclient);
 		}
+		wakeup_post(&disk_wakeup);
 		return(0);
 	}
 
-	/* Read data from the ring buffer one sample at a time.  Ports are interleaved */
-	for (f=0; f < nframes; f++) {
-		for (i=0; i < nports; i++) {
-			jack_ringbuffer_read(buffer, (char *)cbd->buf[i]++,
-				sizeof(jack_default_audio_sample_t));
-		}
+	/* De-interleave the whole period straight out of the ring buffer */
+	cbd->kernel->deinterleave(cbd->buf, (float *)p, nports, 0, nframes);
+	ring_consume(buffer, need);
+
+	/* Wake the disk thread once there is room for a worthwhile read */
+	if (ring_space(buffer) >= cbd->cfg->wakeup)
+		wakeup_post(&disk_wakeup);
+	return(0);
+}
+
+/*
+ * Open the jack client, which tells us the sample rate and period, before
+ * anything is sized from them.  setup_jack starts it running.
+ */
+int
+open_jack(struct config *c)
+{
+	char *clientname = "jack_cat";
+	jack_status_t jackstatus;
+
+	if (c->jackname != NULL) {
+		clientname = c->jackname;
 	}
 
-	if(pthread_mutex_trylock(&disk_mutex) == 0) {
-		pthread_cond_signal(&disk_cond);
-		pthread_mutex_unlock(&disk_mutex);
+	jclient = jack_client_open(clientname, 0, &jackstatus);
+	if (jclient == NULL) {
+		fprintf(stderr, "Error from jack_client_open\n");
+		return(1);
 	}
+	c->rate = jack_get_sample_rate(jclient);
+	c->period = jack_get_buffer_size(jclient);
 	return(0);
 }
 
@@ -385,7 +1013,6 @@ setup_jack(struct config *c)
 {
 	char *clientname = "jack_cat";
 	char port_name[MAX_NAME];
-	jack_status_t jackstatus;
 	unsigned long port_flags;
 	jack_port_t *jp;
 	int i;
@@ -397,20 +1024,23 @@ setup_jack(struct config *c)
 	cbd = (struct callbackdata *)malloc(sizeof(struct callbackdata ));
 	cbd->ready = 0;
 	cbd->cfg = c;
+	cbd->kernel = interleave_select(c->ports);
+	printf("interleave: %s (%s)\n", cbd->kernel->name,
+		interleave_level_name(interleave_level()));
 
 	if (c->jackname != NULL) {
 		clientname = c->jackname;
 	}
 
-	jclient = jack_client_open(clientname, 0, &jackstatus);
-	if (jclient == NULL) {
-		fprintf(stderr, "Error from jack_client_open\n");
-		return(1);
-	}
+	if (c->io == CFG_PLAYBACK && c->header.rate != 0 &&
+	    c->header.rate != c->rate)
+		fprintf(stderr, "%s was recorded at %d Hz, jack runs at %d Hz\n",
+			c->filename, c->header.rate, c->rate);
 
 	switch (c->io) {
 	case CFG_CAPTURE:
 		jack_set_process_callback(jclient, jack_capture_callback, cbd);
+		jack_set_xrun_callback(jclient, jack_xrun_callback, NULL);
 		break;
 	case CFG_PLAYBACK: 
 		jack_set_process_callback(jclient, jack_playback_callback, cbd);
@@ -468,140 +1098,2741 @@ cleanup_jack()
 	jack_client_close(jclient);
 }
 
+static long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000L + ts.tv_nsec);
+}
+
 /*
- * Thread to write data from buffer to disk.
+ * Page cache drop-behind for capture files.
  *
- * When there is no more data to write, it sleeps on disk_cond, expecting a
- * wakeup from the jack callback handler.
- *
- * I/O size is limited to avoid having one long (slow) write block emptying
- * the buffer.
+ * Left alone, the kernel lets written data pile up as dirty pages and then
+ * writes it back in large bursts, and the data stays cached long after we
+ * are done with it.  Instead, each time a window of the file has been
+ * written, writeback of it is started, and the window before it is waited
+ * for and dropped from the cache.  So at most two windows are dirty or
+ * cached at once, and the waits pace the writer to what the disk can take.
  */
-void
-disk_write(void *arg)
+struct writeback {
+	int fd;
+	off_t window;		/* size of a window, 0 for none */
+	off_t started;		/* writeback started on [dropped, started) */
+	off_t dropped;		/* everything before this is dropped */
+};
+
+static void
+writeback_init(struct writeback *wb, int fd, off_t window, off_t start)
 {
-	struct config *c;
-	int fd, n;
-	size_t available, l, w;
-	jack_ringbuffer_data_t vec[3];
-	char label[FILE_HEADER_LEN];
+	wb->fd = fd;
+	wb->window = window;
+	wb->started = start;
+	wb->dropped = start;
+}
 
-	c = (struct config*)arg;
-	printf("disk_write %s\n", c->filename);
+/* Wait for writeback of [wb->dropped, end) and drop it from the cache */
+static void
+writeback_drop(struct writeback *wb, off_t end)
+{
+	long start, us;
 
-	if ((fd = open(c->filename, O_CREAT|O_APPEND|O_RDWR, 0666)) == -1) {
-		fprintf(stderr, "Cannot create file %s\n", c->filename);
-		perror("create");
-		status.stop = 1;
+	if (end <= wb->dropped)
 		return;
-	}
-
-	/* Write a header */
-	n = sprintf(label, "JACK%1d", c->ports);
-	write(fd, label, n+1);
+	start = now_ns();
+	sync_file_range(wb->fd, wb->dropped, end - wb->dropped,
+		SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		SYNC_FILE_RANGE_WAIT_AFTER);
+	us = (now_ns() - start) / 1000;
+	status.wb_latency += (us - status.wb_latency) / 16;
+	if (us > status.wb_latency_max)
+		status.wb_latency_max = us;
+	posix_fadvise(wb->fd, wb->dropped, end - wb->dropped,
+		POSIX_FADV_DONTNEED);
+	wb->dropped = end;
+}
 
-	pthread_mutex_lock(&disk_mutex);
-	while (status.stop == 0) {
-		available = jack_ringbuffer_read_space(buffer);
-		if (available > 0) {
-			/* This writes data directly from the ringbuffer.  */
-			jack_ringbuffer_get_read_vector(buffer, vec);
-			l = vec[0].len;
-			if (l == 0) 
-				continue;	/* should not happen */
-			if (l > c->blocksize)	/* limit writes to blocksize */
-				l = c->blocksize;
-			status.disk_io++;
-			status.disk_bytes += l;
-			w = write(fd, vec[0].buf, l);
-			if (w != l) {
-				fprintf(stderr, "write(%ld) = %ld %d\n", l, w, errno);
-			}
-			jack_ringbuffer_read_advance(buffer, l);
-		} else {
-			pthread_cond_wait(&disk_cond, &disk_mutex);
-		}
+/* The file has been written up to offset written */
+static void
+writeback_advance(struct writeback *wb, off_t written)
+{
+	if (wb->window == 0)
+		return;
+	while (written - wb->started >= wb->window) {
+		sync_file_range(wb->fd, wb->started, wb->window,
+			SYNC_FILE_RANGE_WRITE);
+		writeback_drop(wb, wb->started);
+		wb->started += wb->window;
 	}
+}
 
-	pthread_mutex_unlock(&disk_mutex);
-	close(fd);
-	pthread_exit(NULL);
+/* At close: flush and drop whatever is left */
+static void
+writeback_finish(struct writeback *wb, off_t written)
+{
+	if (wb->window == 0)
+		return;
+	writeback_drop(wb, written);
 }
 
 /*
- * Thread to read data from disk into the buffer
+ * An open capture file.
  *
- * When there is no more space for data, it sleeps on disk_cond, expecting a
- * wakeup from the jack callback handler.
+ * Data is written with explicit offsets at cf->written rather than with
+ * O_APPEND.  Space is allocated ahead of it with fallocate in chunks of
+ * -A bytes, so the filesystem is not allocating blocks and extents on every
+ * write.  FALLOC_FL_KEEP_SIZE leaves the file's size alone, so a capture
+ * that is killed leaves no zeros after its data; capfile_close frees the
+ * blocks it did not use.  Only on a filesystem without it does the
+ * preallocation grow the file, and capfile_close truncates it back.
+ *
+ * With -m, a file is full at cf->limit and the writers switch to the next
+ * one with capfile_rotate.
  */
-void
-disk_read(void *arg)
-{
-	struct config *c;
-	int fd, n;
-	size_t available, l, r;
-	jack_ringbuffer_data_t vec[3];
-	char label[FILE_HEADER_LEN+1];
-
-	c = (struct config*)arg;
-
-	if ((fd = open(c->filename, O_RDONLY, 0)) == -1) {
-		perror(c->filename);
-		status.stop = 1;
-		return;
-	}
+struct capfile {
+	int fd;
+	off_t written;		/* file is complete up to here */
+	off_t allocated;	/* space is preallocated up to here */
+	off_t prealloc;		/* preallocation chunk, 0 for none */
+	int extends;		/* preallocation grows the file size */
+	off_t limit;		/* file is full at this offset, 0 for no limit */
+	uint64_t first;		/* frames in the files before this one */
+	uint64_t frames;	/* frames in the chunks written so far */
+	struct chunk_index index;	/* of a chunked file */
+	struct rotation *rot;	/* where the next file comes from, or NULL */
+	struct config *c;	/* c->header is the file header */
+	struct writeback wb;	/* page cache drop-behind */
+};
 
-	/* Read the header */
-	r = read(fd, label, FILE_HEADER_LEN);
-	if (r < FILE_HEADER_LEN) {
-		fprintf(stderr, "cannot read data from input file: %s\n", c->filename);
-		status.stop = 1;
-		return;
-	}
-	printf("disk_read %s %s\n", c->filename, label);
+/*
+ * Open a capture file.  Without O_TRUNC in flags, data goes after whatever
+ * the file already holds.  Returns -1 if it cannot be opened.
+ */
+static int
+capfile_open(struct capfile *cf, struct config *c, char *name, int flags)
+{
+	if ((cf->fd = open(name, O_CREAT|flags, 0666)) == -1)
+		return (-1);
+	cf->written = lseek(cf->fd, 0, SEEK_END);
+	cf->allocated = cf->written;
+	cf->prealloc = c->prealloc;
+	cf->extends = 0;
+	cf->limit = 0;
+	cf->first = 0;
+	cf->frames = 0;
+	memset(&cf->index, 0, sizeof(struct chunk_index));
+	cf->rot = NULL;
+	cf->c = c;
+	writeback_init(&cf->wb, cf->fd, (flags & O_DIRECT) ? 0 : c->wbwindow,
+		cf->written & ~(off_t)4095);
+	return (0);
+}
 
-	pthread_mutex_lock(&disk_mutex);
-	while (status.stop == 0) {
-		available = jack_ringbuffer_write_space(buffer);
-		if (available > 0) {
-			/* This writes data directly to the ringbuffer.  */
-			jack_ringbuffer_get_write_vector(buffer, vec);
-			l = vec[0].len;
-			if (l == 0) 
-				continue;	/* should not happen */
-			if (l > c->blocksize)	/* limit writes to blocksize */
-				l = c->blocksize;
-			//printf("read(%ld)\n", l);
-			status.disk_io++;
-			status.disk_bytes += l;
-			r = read(fd, vec[0].buf, l);
-			if (r != l) {
-				/* end of file */
-				if (r == 0) {
-					fprintf(stderr, "read() = EOF\n");
-					status.eof = 1;
-					break;
-				}
-			} else {
-				jack_ringbuffer_write_advance(buffer, l);
-			}
-		} else {
-			pthread_cond_wait(&disk_cond, &disk_mutex);
+/* Make sure space is allocated up to end, and a good way beyond it */
+static void
+capfile_reserve(struct capfile *cf, off_t end)
+{
+	off_t len;
+	int err;
+
+	while (cf->prealloc > 0 && end + cf->prealloc / 2 > cf->allocated) {
+		len = cf->prealloc;
+		if (cf->limit > 0 && cf->allocated + len > cf->limit)
+			len = cf->limit - cf->allocated;
+		if (len <= 0)
+			break;
+		err = -1;
+		if (!cf->extends) {
+			err = fallocate(cf->fd, FALLOC_FL_KEEP_SIZE,
+				cf->allocated, len);
+			if (err != 0 && errno == EOPNOTSUPP)
+				cf->extends = 1;
+		}
+		if (cf->extends)
+			err = fallocate(cf->fd, 0, cf->allocated, len);
+		if (err != 0) {
+			fprintf(stderr, "fallocate: %s, not preallocating\n",
+				strerror(errno));
+			cf->prealloc = 0;
+			break;
 		}
+		cf->allocated += len;
 	}
+}
 
-	pthread_mutex_unlock(&disk_mutex);
-	close(fd);
-	pthread_exit(NULL);
+/* Bytes, up to max, that still fit in the file at offset off */
+static size_t
+capfile_room(struct capfile *cf, off_t off, size_t max)
+{
+	if (cf->limit > 0 && cf->limit - off < max)
+		return (cf->limit - off);
+	return (max);
 }
 
-/*
- * Create threads that read/write disk files, open files.
- */
-void
-start_io(struct config *c)
+/* Is the file full at offset off? */
+static int
+capfile_full(struct capfile *cf, off_t off)
 {
-	void *func;
+	return (cf->limit > 0 && off >= cf->limit);
+}
+
+/* The file is complete up to offset written */
+static void
+capfile_written(struct capfile *cf, off_t written)
+{
+	cf->written = written;
+	writeback_advance(&cf->wb, written);
+}
+
+/* Frames in the file so far; chunks need not hold frames of data */
+static uint64_t
+capfile_frames(struct capfile *cf)
+{
+	struct file_header *h = &cf->c->header;
+
+	if (h->chunk > 0)
+		return (cf->frames);
+	return ((cf->written - header_size(h)) / header_frame_size(h));
+}
+
+/*
+ * Rewrite the header with the sample rate and the time of the file's first
+ * frame, which are not known yet when a file is opened.  The time is
+ * worked out from when the capture started and how much came before.
+ */
+static void
+capfile_stamp(struct capfile *cf)
+{
+	struct file_header h = cf->c->header;
+	size_t len = header_size(&h);
+	uint64_t frames = cf->first;
+	char *buf;
+
+	h.rate = cf->c->rate;
+	h.period = cf->c->period;
+	if (__atomic_load_n(&capture_start.known, __ATOMIC_ACQUIRE)) {
+		h.start_frame = capture_start.frame + frames;
+		h.start_ns = capture_start.ns;
+		if (h.rate > 0)
+			h.start_ns += frames * 1000000000ULL / h.rate;
+	}
+	/* aligned, in case the file is O_DIRECT */
+	if (posix_memalign((void **)&buf, FORMAT_ALIGN, len) != 0)
+		return;
+	header_encode(&h, buf);
+	if (pwrite(cf->fd, buf, len, 0) != len)
+		perror("header rewrite");
+	free(buf);
+}
+
+/* Write the index of a chunked file after the last chunk */
+static void
+capfile_index(struct capfile *cf)
+{
+	size_t len = index_size(&cf->index);
+	char *buf = malloc(len);
+
+	/* the index is not aligned, so O_DIRECT is done with */
+	fcntl(cf->fd, F_SETFL, fcntl(cf->fd, F_GETFL) & ~O_DIRECT);
+	index_encode(&cf->index, cf->written, buf);
+	if (pwrite(cf->fd, buf, len, cf->written) != len)
+		perror("index write");
+	else
+		cf->written += len;
+	free(buf);
+	index_free(&cf->index);
+}
+
+/*
+ * Finish the file: write the chunk index, stamp, flush, give back the
+ * unused preallocation, cut off O_DIRECT padding, close.
+ */
+static void
+capfile_close(struct capfile *cf)
+{
+	struct stat st;
+
+	if (cf->c->header.chunk > 0)
+		capfile_index(cf);
+	capfile_stamp(cf);
+	writeback_finish(&cf->wb, cf->written);
+	/* truncating to the same size frees the blocks past the end too */
+	if (cf->allocated > cf->written ||
+	    (fstat(cf->fd, &st) == 0 && st.st_size > cf->written)) {
+		if (ftruncate(cf->fd, cf->written) == -1)
+			perror("ftruncate");
+	}
+	close(cf->fd);
+	cf->fd = -1;
+}
+
+/* Write the file header at the current end of the file */
+static void
+capfile_header(struct capfile *cf, char *label, int hlen)
+{
+	capfile_reserve(cf, cf->written + hlen);
+	if (pwrite(cf->fd, label, hlen, cf->written) != hlen)
+		perror("header write");
+	capfile_written(cf, cf->written + hlen);
+}
+
+/*
+ * Capture file rotation (-m).
+ *
+ * Opening, preallocating and closing a file can each block for a long time,
+ * so the disk thread does none of them at a rotation.  A helper thread keeps
+ * the next file open, preallocated and with its header written, and closes
+ * (truncates, flushes) each full file handed back to it.  capfile_rotate
+ * only swaps in the prepared file, unless the helper has fallen behind.
+ */
+struct rotation {
+	struct config *c;
+	int flags;		/* open flags */
+	char *label;		/* file header */
+	int hlen;
+	int seq;		/* number to try for the next file */
+	char *name;		/* name of the file opened last */
+	size_t namelen;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct capfile next;	/* the next file, when ready */
+	int ready;
+	struct capfile old;	/* a full file to close, when closing */
+	int closing;
+	int failed;		/* cannot open any more files */
+	int stop;
+};
+
+/*
+ * Open the next numbered file that does not exist yet, and write its
+ * header.  Its limit is set so that it holds whole frames; for a chunked
+ * file chunk_room leaves room for the index.
+ */
+static int
+rotation_open(struct rotation *rot, struct capfile *cf)
+{
+	off_t framesize = header_frame_size(&rot->c->header);
+	off_t data;
+
+	for (;;) {
+		snprintf(rot->name, rot->namelen, "%s.%04d",
+			rot->c->filename, rot->seq++);
+		if (capfile_open(cf, rot->c, rot->name, rot->flags|O_EXCL) == 0)
+			break;
+		if (errno != EEXIST) {
+			fprintf(stderr, "Cannot create file %s: %s\n",
+				rot->name, strerror(errno));
+			return (-1);
+		}
+	}
+	data = (off_t)rot->c->maxsize - rot->hlen;
+	data -= data % framesize;
+	if (data < framesize)		/* port names made the header bigger */
+		data = framesize;
+	cf->limit = rot->hlen + data;
+	cf->rot = rot;
+	capfile_header(cf, rot->label, rot->hlen);
+	printf("capture file %s\n", rot->name);
+	return (0);
+}
+
+static void *
+rotation_thread(void *arg)
+{
+	struct rotation *rot = (struct rotation *)arg;
+	struct capfile cf;
+	int err;
+
+	pthread_mutex_lock(&rot->lock);
+	for (;;) {
+		if (!rot->ready && !rot->failed && !rot->stop) {
+			pthread_mutex_unlock(&rot->lock);
+			err = rotation_open(rot, &cf);
+			pthread_mutex_lock(&rot->lock);
+			if (err == 0) {
+				rot->next = cf;
+				rot->ready = 1;
+			} else {
+				rot->failed = 1;
+			}
+			pthread_cond_broadcast(&rot->cond);
+		} else if (rot->closing) {
+			cf = rot->old;
+			pthread_mutex_unlock(&rot->lock);
+			capfile_close(&cf);
+			pthread_mutex_lock(&rot->lock);
+			rot->closing = 0;
+			pthread_cond_broadcast(&rot->cond);
+		} else if (rot->stop) {
+			break;
+		} else {
+			pthread_cond_wait(&rot->cond, &rot->lock);
+		}
+	}
+	pthread_mutex_unlock(&rot->lock);
+	return (NULL);
+}
+
+/* Open the first file into cf and start the helper thread */
+static int
+rotation_start(struct rotation *rot, struct config *c, int flags,
+	char *label, int hlen, struct capfile *cf)
+{
+	memset(rot, 0, sizeof(struct rotation));
+	rot->c = c;
+	rot->flags = flags;
+	rot->label = label;
+	rot->hlen = hlen;
+	rot->namelen = strlen(c->filename) + 16;
+	rot->name = malloc(rot->namelen);
+	if (rotation_open(rot, cf) == -1) {
+		free(rot->name);
+		return (-1);
+	}
+	pthread_mutex_init(&rot->lock, NULL);
+	pthread_cond_init(&rot->cond, NULL);
+	pthread_create(&rot->thread, NULL, rotation_thread, rot);
+	return (0);
+}
+
+/* Stop the helper; the file it had ready is not needed */
+static void
+rotation_stop(struct rotation *rot)
+{
+	pthread_mutex_lock(&rot->lock);
+	rot->stop = 1;
+	pthread_cond_broadcast(&rot->cond);
+	pthread_mutex_unlock(&rot->lock);
+	pthread_join(rot->thread, NULL);
+	if (rot->ready) {
+		capfile_close(&rot->next);
+		unlink(rot->name);
+	}
+	free(rot->name);
+}
+
+/*
+ * cf is full and everything for it has been written: hand it to the helper
+ * to close and carry on in the next file.  If no more files can be opened,
+ * this one grows past the limit rather than losing data.
+ */
+static void
+capfile_rotate(struct capfile *cf)
+{
+	struct rotation *rot = cf->rot;
+
+	pthread_mutex_lock(&rot->lock);
+	if ((!rot->ready && !rot->failed) || rot->closing)
+		status.rotate_waits++;
+	while ((!rot->ready && !rot->failed) || rot->closing)
+		pthread_cond_wait(&rot->cond, &rot->lock);
+	if (rot->ready) {
+		rot->old = *cf;
+		rot->closing = 1;
+		*cf = rot->next;
+		cf->first = rot->old.first + capfile_frames(&rot->old);
+		rot->ready = 0;
+		status.files++;
+	} else {
+		fprintf(stderr, "no next capture file, ignoring -m\n");
+		cf->limit = 0;
+	}
+	pthread_cond_broadcast(&rot->cond);
+	pthread_mutex_unlock(&rot->lock);
+}
+
+/*
+ * Open the capture file, or with -m the first of the numbered files, and
+ * write its header.  The header is a whole number of aligned blocks, so
+ * that works with O_DIRECT too.
+ */
+static int
+capfile_start(struct capfile *cf, struct rotation *rot, struct config *c,
+	int flags, char *label, int hlen)
+{
+	if (c->maxsize > 0)
+		return (rotation_start(rot, c, flags, label, hlen, cf));
+	if (capfile_open(cf, c, c->filename, flags) == -1)
+		return (-1);
+	capfile_header(cf, label, hlen);
+	return (0);
+}
+
+/*
+ * A flat file has nowhere to put the gaps in it, so they are listed in
+ * filename.gaps, one a line: the frame of the capture it comes before
+ * (counting on through the files of -m), its length in frames, what it
+ * was, and the jack frame time it started at.
+ */
+static void
+gaps_log(struct config *c)
+{
+	struct gap *g;
+	char *name;
+
+	while ((g = gap_peek()) != NULL) {
+		if (gaps.log == NULL && !gaps.nolog) {
+			/* tried once: the gaps are still counted in status */
+			name = malloc(strlen(c->filename) + 6);
+			sprintf(name, "%s.gaps", c->filename);
+			if ((gaps.log = fopen(name, "w")) == NULL) {
+				perror(name);
+				gaps.nolog = 1;
+			} else {
+				fprintf(gaps.log, "# frame frames kind time\n");
+			}
+			free(name);
+		}
+		if (gaps.log != NULL)
+			fprintf(gaps.log, "%llu %u %s %llu\n",
+				(unsigned long long)g->at, g->frames,
+				g->kind == GAP_XRUN ? "xrun" :
+				g->kind == GAP_OVERFLOW ? "overflow" :
+				"xrun+overflow",
+				(unsigned long long)g->time);
+		gap_pop();
+	}
+}
+
+/* Close the last capture file, and stop rotation */
+static void
+capfile_finish(struct capfile *cf)
+{
+	struct rotation *rot = cf->rot;
+
+	if (cf->c->header.chunk == 0) {
+		gaps_log(cf->c);
+		if (gaps.log != NULL)
+			fclose(gaps.log);
+	}
+	capfile_close(cf);
+	if (rot != NULL)
+		rotation_stop(rot);
+}
+
+/* Do the len bytes at p in the ringbuffer run on past the wrap? */
+static int
+ring_wraps(const char *p, size_t len)
+{
+	return (p + len > buffer->buf + buffer->size);
+}
+
+/*
+ * Conversion between the floats in the ringbuffer and the stored sample
+ * format (-f), done by the disk thread as it copies data out of or into
+ * the ringbuffer.  Writes and reads of the file need not hold whole stored
+ * samples (a staging buffer is not a multiple of 3 bytes), so carry holds
+ * the part of a sample that has not been taken yet: on capture the rest of
+ * a converted sample, on playback the start of one still to be converted.
+ */
+struct convert {
+	const struct convert_kernel *k;
+	uint32_t seed[DITHER_LANES];
+	uint32_t *dither;	/* seed, or NULL for no dither */
+	char carry[sizeof(jack_default_audio_sample_t)];
+	size_t ncarry;
+};
+
+static void
+convert_init(struct convert *cv, struct config *c)
+{
+	cv->k = convert_select(c->header.format);
+	dither_init(cv->seed);
+	cv->dither = c->dither ? cv->seed : NULL;
+	cv->ncarry = 0;
+	if (c->header.format != FORMAT_FLOAT32)
+		printf("%s samples, converted by %s%s\n",
+			header_format_name(c->header.format), cv->k->name,
+			cv->dither ? ", dithered" : "");
+}
+
+/* Stored bytes that ring bytes of floats in the ringbuffer make */
+static size_t
+convert_stored(struct convert *cv, size_t ring)
+{
+	return (cv->ncarry + ring / sizeof(float) * cv->k->size);
+}
+
+/* Stored bytes that convert to fit in ring bytes of ringbuffer space */
+static size_t
+convert_room(struct convert *cv, size_t ring)
+{
+	size_t n = ring / sizeof(float) * cv->k->size;
+
+	return (n > cv->ncarry ? n - cv->ncarry : 0);
+}
+
+/*
+ * Take len bytes of stored samples out of the ringbuffer into dst; len is
+ * at most what convert_stored says there is.
+ */
+static void
+ring_encode(struct convert *cv, char *dst, size_t len)
+{
+	size_t l, n, size = cv->k->size;
+	float f;
+	char *p;
+
+	l = len < cv->ncarry ? len : cv->ncarry;
+	memcpy(dst, cv->carry, l);
+	memmove(cv->carry, cv->carry + l, cv->ncarry - l);
+	cv->ncarry -= l;
+	dst += l;
+	len -= l;
+
+	n = len / size;			/* whole samples */
+	if (n > 0) {
+		ring_peek(buffer, n * sizeof(float), &p);
+		cv->k->encode(dst, (float *)p, n, cv->dither);
+		ring_consume(buffer, n * sizeof(float));
+		dst += n * size;
+		len -= n * size;
+	}
+	if (len > 0) {			/* the start of one more */
+		ring_read(buffer, (char *)&f, sizeof(float));
+		cv->k->encode(cv->carry, &f, 1, cv->dither);
+		memcpy(dst, cv->carry, len);
+		memmove(cv->carry, cv->carry + len, size - len);
+		cv->ncarry = size - len;
+	}
+}
+
+/*
+ * Put len bytes of stored samples from src into the ringbuffer, as floats;
+ * len is at most what convert_room says fits.
+ */
+static void
+ring_decode(struct convert *cv, const char *src, size_t len)
+{
+	size_t l, n, size = cv->k->size;
+	float f;
+	char *p;
+
+	if (cv->ncarry > 0) {		/* finish the split sample */
+		l = size - cv->ncarry;
+		if (l > len)
+			l = len;
+		memcpy(cv->carry + cv->ncarry, src, l);
+		cv->ncarry += l;
+		src += l;
+		len -= l;
+		if (cv->ncarry < size)
+			return;
+		cv->k->decode(&f, cv->carry, 1);
+		ring_write(buffer, (char *)&f, sizeof(float));
+		cv->ncarry = 0;
+	}
+
+	n = len / size;
+	if (n > 0) {
+		ring_reserve(buffer, n * sizeof(float), &p);
+		cv->k->decode((float *)p, src, n);
+		ring_commit(buffer, n * sizeof(float));
+		src += n * size;
+		len -= n * size;
+	}
+	memcpy(cv->carry, src, len);	/* the start of one more */
+	cv->ncarry = len;
+}
+
+/*
+ * One io_uring request: a block of the ringbuffer being written to or read
+ * from the file.
+ */
+struct uring_req {
+	char *buf;		/* ringbuffer data */
+	struct iovec cur;	/* what is left of it after a short transfer */
+	size_t len;		/* bytes at buf */
+	size_t done;		/* bytes transferred so far */
+	off_t off;		/* file offset */
+	int eof;		/* read hit the end of the file */
+	long submitted;		/* time it was first submitted, ns */
+};
+
+/* Account for the completion latency of a finished request */
+static void
+uring_latency(struct uring_req *r)
+{
+	long us = (now_ns() - r->submitted) / 1000;
+
+	/* moving average over roughly the last 16 requests */
+	status.uring_latency += (us - status.uring_latency) / 16;
+	if (us > status.uring_latency_max)
+		status.uring_latency_max = us;
+}
+
+/* (Re)queue the part of r that has not been transferred yet */
+static void
+uring_queue(struct uring *u, int op, int fd, struct uring_req *r, int slot)
+{
+	struct io_uring_sqe *sqe;
+
+	r->cur.iov_base = r->buf + r->done;
+	r->cur.iov_len = r->len - r->done;
+	sqe = uring_get_sqe(u);		/* never full: one sqe per slot */
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)&r->cur;
+	sqe->len = 1;
+	sqe->off = r->off + r->done;
+	sqe->user_data = slot;
+}
+
+/*
+ * io_uring version of the disk_write loop.
+ *
+ * Up to qdepth block-sized writes are in flight at once, straight from the
+ * ringbuffer, each at its own file offset.  Writes may complete in any
+ * order; the ringbuffer read pointer is only advanced past the oldest
+ * writes once they are complete, so jack cannot overwrite data the kernel
+ * is still writing.  A slow write no longer stops draining as long as
+ * there are other slots free.
+ *
+ * With -m, writes stop at the end of the file; once they are all complete
+ * it is rotated and writing carries on in the next one.
+ *
+ * A write that is interrupted or would block is queued again.  Any other
+ * failure stops the capture: the writes still in flight are waited for,
+ * and the file ends at the last byte before the failed write.
+ *
+ * Returns -1 without writing anything if io_uring cannot be used.
+ */
+static int
+disk_write_uring(struct config *c, struct capfile *cf)
+{
+	struct uring u;
+	struct uring_req *req, *r;
+	struct io_uring_cqe *cqe;
+	int head = 0, count = 0;	/* FIFO of requests in flight */
+	size_t inflight = 0;		/* bytes in flight */
+	size_t available;
+	unsigned int seq;
+	char *p;
+	off_t off;
+	int busy = 0;			/* requests not finished */
+	int failed = 0;
+	int err, slot, stopping;
+
+	if ((err = uring_init(&u, c->qdepth)) < 0) {
+		fprintf(stderr, "io_uring unavailable (%s), using writev\n",
+			strerror(-err));
+		return (-1);
+	}
+	req = calloc(c->qdepth, sizeof(struct uring_req));
+	off = cf->written;
+	status.uring = 1;
+
+	for (;;) {
+		gaps_log(c);
+
+		/* collect completions */
+		while ((cqe = uring_peek_cqe(&u)) != NULL) {
+			r = &req[cqe->user_data];
+			if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+				uring_queue(&u, IORING_OP_WRITEV, cf->fd, r,
+					cqe->user_data);
+				uring_submit(&u, 0);
+			} else if (cqe->res <= 0) {
+				fprintf(stderr, "io_uring write(%ld): %s, "
+					"stopping\n", r->len - r->done,
+					cqe->res < 0 ? strerror(-cqe->res) :
+					"nothing written");
+				failed = 1;
+				status.stop = 1;
+				busy--;
+			} else {
+				r->done += cqe->res;
+				if (r->done < r->len) {
+					uring_queue(&u, IORING_OP_WRITEV,
+						cf->fd, r, cqe->user_data);
+					uring_submit(&u, 0);
+				} else {
+					uring_latency(r);
+					busy--;
+				}
+			}
+			uring_cqe_seen(&u);
+		}
+
+		/* retire the oldest writes once they are complete */
+		while (count > 0 && req[head].done == req[head].len) {
+			ring_consume(buffer, req[head].len);
+			inflight -= req[head].len;
+			capfile_written(cf, req[head].off + req[head].len);
+			head = (head + 1) % c->qdepth;
+			count--;
+		}
+		status.disk_inflight = count;
+
+		/* the failed write and everything after it stay in the ring */
+		if (failed) {
+			if (busy == 0)
+				break;
+			uring_wait_cqe(&u, &cqe);
+			continue;
+		}
+
+		/* when stopping, everything left in the ring is written */
+		stopping = status.stop;
+		seq = wakeup_prepare(&disk_wakeup);
+		available = ring_fill(buffer) - inflight;
+		if (count < c->qdepth && (available >= c->wakeup ||
+		    (stopping && available > 0))) {
+			if (capfile_full(cf, off)) {
+				if (count > 0) {
+					uring_wait_cqe(&u, &cqe);
+					continue;
+				}
+				capfile_rotate(cf);
+				off = cf->written;
+			}
+			slot = (head + count) % c->qdepth;
+			r = &req[slot];
+			ring_peek(buffer, inflight + available, &p);
+			r->buf = p + inflight;
+			r->len = capfile_room(cf, off, c->blocksize);
+			if (r->len > available)
+				r->len = available;
+			r->done = 0;
+			r->off = off;
+			capfile_reserve(cf, off + r->len);
+			r->submitted = now_ns();
+			off += r->len;
+			inflight += r->len;
+			count++;
+			busy++;
+			if (ring_wraps(r->buf, r->len))
+				status.disk_wrapped++;
+			status.disk_io++;
+			status.disk_bytes += r->len;
+			uring_queue(&u, IORING_OP_WRITEV, cf->fd, r, slot);
+			uring_submit(&u, 0);
+		} else if (count > 0) {
+			uring_wait_cqe(&u, &cqe);
+		} else if (stopping) {
+			break;
+		} else {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+		}
+	}
+
+	status.disk_inflight = 0;
+	free(req);
+	uring_exit(&u);
+	return (0);
+}
+
+/*
+ * Staging buffers, for the capture writers that copy data out of the
+ * ringbuffer instead of writing straight from it: O_DIRECT (which needs the
+ * memory, the length and the file offset aligned, and the ringbuffer is
+ * none of those) and chunked files.  A pool of page-aligned buffers is
+ * filled one at a time, and each is written through io_uring with the
+ * others still in flight when it is available, otherwise with pwrite.
+ *
+ * A short write is carried on from where it stopped (with O_DIRECT it
+ * stops on an aligned boundary), and an interrupted one is tried again.
+ * Any other failure stops the capture; st->failed says where the file's
+ * good data ends.
+ */
+struct stage_buf {
+	char *buf;
+	size_t len;		/* bytes being written */
+	size_t done;		/* bytes written so far */
+	off_t off;		/* where to */
+	int fd;
+	int busy;		/* write in flight */
+	long submitted;		/* time the write was submitted, ns */
+};
+
+struct stage {
+	struct stage_buf *pool;
+	int nbuf;
+	size_t bufsize;
+	int cur;		/* the buffer being filled */
+	off_t failed;		/* offset of a failed write, -1 for none */
+	int use_uring;
+	struct uring u;
+};
+
+/* nbuf buffers, or with 0 enough to keep the io_uring queue full */
+static int
+stage_init(struct stage *st, struct config *c, size_t bufsize, int nbuf)
+{
+	int i, err;
+
+	st->bufsize = (bufsize + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN-1);
+	st->nbuf = c->qdepth > 1 ? c->qdepth : 2;
+	if (nbuf > st->nbuf)
+		st->nbuf = nbuf;
+	st->cur = 0;
+	st->failed = -1;
+	st->pool = calloc(st->nbuf, sizeof(struct stage_buf));
+	for (i=0; i < st->nbuf; i++) {
+		if (posix_memalign((void **)&st->pool[i].buf, DIRECT_ALIGN,
+		    st->bufsize) != 0) {
+			fprintf(stderr, "cannot allocate staging buffers\n");
+			status.stop = 1;
+			return (-1);
+		}
+	}
+	st->use_uring = 0;
+	if (c->qdepth > 0) {
+		if ((err = uring_init(&st->u, st->nbuf)) == 0) {
+			st->use_uring = 1;
+			status.uring = 1;
+		} else {
+			fprintf(stderr, "io_uring unavailable (%s), using pwrite\n",
+				strerror(-err));
+		}
+	}
+	return (0);
+}
+
+/* (Re)queue the part of buffer i that has not been written yet */
+static void
+stage_queue(struct stage *st, int i)
+{
+	struct stage_buf *d = &st->pool[i];
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&st->u);	/* never full: one sqe per buffer */
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = d->fd;
+	sqe->addr = (unsigned long)(d->buf + d->done);
+	sqe->len = d->len - d->done;
+	sqe->off = d->off + d->done;
+	sqe->user_data = i;
+	uring_submit(&st->u, 0);
+}
+
+/* A write of d failed with errno err (0: it wrote nothing); stop */
+static void
+stage_fail(struct stage *st, struct stage_buf *d, int err)
+{
+	off_t at = d->off + d->done;
+
+	fprintf(stderr, "write(%ld) at %lld: %s, stopping\n",
+		d->len - d->done, (long long)at,
+		err ? strerror(err) : "nothing written");
+	if (st->failed == -1 || at < st->failed)
+		st->failed = at;
+	status.stop = 1;
+}
+
+/*
+ * Collect io_uring completions of staging buffer writes.  With wait, block
+ * until there is at least one.  Returns the number of writes finished.
+ */
+static int
+stage_reap(struct stage *st, int wait)
+{
+	struct io_uring_cqe *cqe;
+	struct stage_buf *d;
+	long us;
+	int n = 0, res;
+
+	if (!st->use_uring)
+		return (0);
+	for (;;) {
+		if ((cqe = uring_peek_cqe(&st->u)) == NULL) {
+			if (!wait || n > 0 || uring_wait_cqe(&st->u, &cqe) < 0)
+				break;
+		}
+		d = &st->pool[cqe->user_data];
+		res = cqe->res;
+		uring_cqe_seen(&st->u);
+		if (res == -EAGAIN || res == -EINTR ||
+		    (res > 0 && (d->done += res) < d->len)) {
+			stage_queue(st, d - st->pool);
+			continue;
+		}
+		if (res <= 0)
+			stage_fail(st, d, -res);
+		d->busy = 0;
+		us = (now_ns() - d->submitted) / 1000;
+		status.uring_latency += (us - status.uring_latency) / 16;
+		if (us > status.uring_latency_max)
+			status.uring_latency_max = us;
+		status.disk_inflight--;
+		n++;
+	}
+	return (n);
+}
+
+/* Write len bytes of the current buffer at off, and move on to the next */
+static void
+stage_write(struct stage *st, struct capfile *cf, size_t len, off_t off)
+{
+	struct stage_buf *d = &st->pool[st->cur];
+	ssize_t w;
+
+	capfile_reserve(cf, off + len);
+	d->len = len;
+	d->done = 0;
+	d->off = off;
+	d->fd = cf->fd;
+	if (st->use_uring) {
+		d->busy = 1;
+		d->submitted = now_ns();
+		status.disk_inflight++;
+		stage_queue(st, st->cur);
+	} else {
+		while (d->done < len) {
+			w = pwrite(cf->fd, d->buf + d->done, len - d->done,
+				off + d->done);
+			if (w > 0)
+				d->done += w;
+			else if (w == 0 || errno != EINTR) {
+				stage_fail(st, d, w == 0 ? 0 : errno);
+				break;
+			}
+		}
+	}
+	st->cur = (st->cur + 1) % st->nbuf;
+	while (st->pool[st->cur].busy)
+		stage_reap(st, 1);
+}
+
+/*
+ * Everything before the returned offset is written; end is what is queued.
+ * After a failed write it is where the failure was.
+ */
+static off_t
+stage_done(struct stage *st, off_t end)
+{
+	int i;
+
+	if (st->failed != -1 && st->failed < end)
+		end = st->failed;
+	for (i=0; i < st->nbuf; i++) {
+		if (st->pool[i].busy && st->pool[i].off < end)
+			end = st->pool[i].off;
+	}
+	return (end);
+}
+
+/* Wait for all writes in flight */
+static void
+stage_drain(struct stage *st)
+{
+	while (status.disk_inflight > 0)
+		stage_reap(st, 1);
+}
+
+static void
+stage_exit(struct stage *st)
+{
+	int i;
+
+	stage_drain(st);
+	if (st->use_uring)
+		uring_exit(&st->u);
+	for (i=0; i < st->nbuf; i++)
+		free(st->pool[i].buf);
+	free(st->pool);
+}
+
+/* Is the file open with O_DIRECT?  Not if that open failed. */
+static int
+capfile_direct(struct capfile *cf)
+{
+	return ((fcntl(cf->fd, F_GETFL) & O_DIRECT) != 0);
+}
+
+/*
+ * Write the fill bytes in buf, the last of the file, at offset off.  They
+ * are padded with zeros to the alignment; capfile_close cuts that off.
+ * If the write fails the capture stops, the file ends at off and -1 is
+ * returned.
+ */
+static int
+direct_tail(struct capfile *cf, char *buf, size_t fill, off_t off)
+{
+	size_t pad, done;
+	ssize_t w;
+
+	if (fill > 0) {
+		pad = (fill + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN-1);
+		memset(buf + fill, 0, pad - fill);
+		for (done = 0; done < pad; done += w) {
+			w = pwrite(cf->fd, buf + done, pad - done, off + done);
+			if (w == -1 && errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			if (w <= 0) {
+				fprintf(stderr, "%swrite(%ld) at %lld: %s, "
+					"stopping\n",
+					capfile_direct(cf) ? "O_DIRECT " : "",
+					pad - done, (long long)(off + done),
+					w == 0 ? "nothing written" :
+					strerror(errno));
+				status.stop = 1;
+				capfile_written(cf, off);
+				return (-1);
+			}
+		}
+		status.disk_io++;
+		status.disk_bytes += fill;
+	}
+	capfile_written(cf, off + fill);
+	return (0);
+}
+
+/*
+ * O_DIRECT version of the disk_write loop.
+ *
+ * Data is copied from the ringbuffer into staging buffers of blocksize
+ * (rounded up to DIRECT_ALIGN).  Each full buffer is written at the next
+ * aligned file offset.  The file header is a whole number of aligned
+ * blocks, so every write stays aligned.
+ *
+ * At the end the partly filled last buffer is padded with zeros to the
+ * alignment and written; capfile_close truncates the file back to the real
+ * length.  With -m the same is done when a file is full.
+ *
+ * Reduced precision formats (-f) use this loop without O_DIRECT too: the
+ * samples are converted as they are copied into the staging buffers, and
+ * the file is marked written as the writes complete, for -W drop-behind.
+ */
+static void
+disk_write_direct(struct config *c, struct capfile *cf)
+{
+	struct stage st;
+	struct convert cv;
+	int stopping;
+	size_t fill, available, stored, l;
+	unsigned int seq;
+	off_t off;
+
+	if (stage_init(&st, c, c->blocksize, 0) == -1)
+		return;
+	convert_init(&cv, c);
+	printf("%s%d staging buffers of %ld bytes\n",
+		capfile_direct(cf) ? "O_DIRECT: " : "", st.nbuf, st.bufsize);
+
+	off = cf->written;		/* just past the header */
+	fill = 0;
+
+	for (;;) {
+		gaps_log(c);
+		stage_reap(&st, 0);
+		capfile_written(cf, stage_done(&st, off));
+		if (st.failed != -1)
+			break;
+
+		/* when stopping, everything left in the ring is written */
+		stopping = status.stop;
+		seq = wakeup_prepare(&disk_wakeup);
+		available = ring_fill(buffer);
+		stored = convert_stored(&cv, available);
+		if (stopping && stored == 0)
+			break;
+		if (!stopping && available < c->wakeup &&
+		    stored < st.bufsize - fill) {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+			continue;
+		}
+
+		if (capfile_full(cf, off + fill)) {
+			stage_drain(&st);
+			if (st.failed != -1)
+				break;
+			if (direct_tail(cf, st.pool[st.cur].buf, fill,
+			    off) == -1) {
+				fill = 0;	/* not to be tried again */
+				break;
+			}
+			capfile_rotate(cf);
+			fill = 0;
+			off = cf->written;
+		}
+
+		l = capfile_room(cf, off + fill, st.bufsize - fill);
+		if (l > stored)
+			l = stored;
+		ring_encode(&cv, st.pool[st.cur].buf + fill, l);
+		fill += l;
+		if (fill < st.bufsize)
+			continue;
+
+		/* staging buffer is full: write it */
+		status.disk_io++;
+		status.disk_bytes += st.bufsize;
+		stage_write(&st, cf, st.bufsize, off);
+		off += st.bufsize;
+		fill = 0;
+	}
+
+	/* Wait for writes in flight, then write the unaligned tail */
+	stage_drain(&st);
+	if (st.failed == -1)
+		direct_tail(cf, st.pool[st.cur].buf, fill, off);
+	else
+		capfile_written(cf, st.failed);
+	stage_exit(&st);
+}
+
+/*
+ * Payload that the next chunk, starting at off, can hold: a whole chunk,
+ * or with -m what still fits in the file in front of its index, which
+ * will also list the pending chunks not written yet.  0 when the file is
+ * full.
+ */
+static size_t
+chunk_room(struct capfile *cf, off_t off, int pending)
+{
+	struct file_header *h = &cf->c->header;
+	size_t framesize = header_frame_size(h);
+	off_t room;
+
+	if (cf->limit == 0)
+		return (h->chunk);
+	/* the index, with this chunk and the pending ones, goes at the end */
+	room = cf->limit - off - index_size(&cf->index) -
+		(pending + 1) * INDEX_ENTRY_LEN;
+	room -= room % h->align;
+	room -= CHUNK_HDR_LEN;
+	if (room < (off_t)framesize)
+		return (0);
+	room -= room % framesize;
+	return (room < h->chunk ? room : h->chunk);
+}
+
+/*
+ * Finish the chunk in the current staging buffer, with len bytes of
+ * payload holding frames frames, and write it at off.  Every chunk gets a
+ * CRC of its header and payload.  Returns the space it takes in the file.
+ */
+static size_t
+chunk_put(struct stage *st, struct capfile *cf, size_t len, size_t frames,
+	int flags, off_t off)
+{
+	struct file_header *h = &cf->c->header;
+	char *buf = st->pool[st->cur].buf;
+	struct chunk k;
+	size_t stride;
+
+	k.len = len;
+	k.frame = cf->frames;
+	k.frames = frames;
+	k.flags = flags | CHUNK_CRC;
+	k.crc = 0;
+	chunk_encode(&k, buf);
+	chunk_seal(buf, len);
+	stride = chunk_stride(h, len);
+	memset(buf + CHUNK_HDR_LEN + len, 0, stride - CHUNK_HDR_LEN - len);
+	index_add(&cf->index, k.frame, off);
+	cf->frames += k.frames;
+	status.disk_io++;
+	status.disk_bytes += stride;
+	stage_write(st, cf, stride, off);
+	return (stride);
+}
+
+/*
+ * A chunk being compressed (-z).  Its frames are copied out of the
+ * ringbuffer into raw, and a worker encodes them into the payload of a
+ * staging buffer, or copies them there unchanged when encoding does not
+ * make them smaller.
+ */
+struct zjob {
+	struct job j;
+	char *raw;		/* frames from the ringbuffer */
+	size_t len;		/* bytes of them */
+	char *out;		/* payload of the staging buffer */
+	size_t zlen;		/* bytes of payload */
+	int flags;		/* CHUNK_CODED if encoded */
+	int channels;
+	long us;		/* time it took */
+};
+
+static void
+zjob_encode(struct job *j)
+{
+	struct zjob *z = (struct zjob *)j;
+	size_t framesize = z->channels * sizeof(jack_default_audio_sample_t);
+	long start = now_ns();
+
+	z->zlen = codec_encode(z->out, (float *)z->raw, z->len / framesize,
+		z->channels);
+	z->flags = CHUNK_CODED;
+	if (z->zlen >= z->len) {
+		memcpy(z->out, z->raw, z->len);
+		z->zlen = z->len;
+		z->flags = 0;
+	}
+	z->us = (now_ns() - start) / 1000;
+}
+
+/*
+ * Write the oldest chunk with the workers, from staging buffer st->cur,
+ * once it is encoded.  Returns the space it takes in the file.
+ */
+static size_t
+zjob_put(struct workers *w, struct zjob *zj, struct stage *st,
+	struct capfile *cf, off_t off)
+{
+	struct zjob *z = &zj[st->cur];
+	size_t framesize = z->channels * sizeof(jack_default_audio_sample_t);
+
+	workers_wait(w, &z->j);
+	status.raw_bytes += z->len;
+	status.coded_bytes += z->zlen;
+	status.codec_us += (z->us - status.codec_us) / 16;
+	if (z->us > status.codec_us_max)
+		status.codec_us_max = z->us;
+	return (chunk_put(st, cf, z->zlen, z->len / framesize, z->flags, off));
+}
+
+/*
+ * Frames of the ringbuffer data at p, out of frames, that come before a
+ * span of silence worth eliding (-S): one of at least SILENCE_FRAMES
+ * quiet frames.  Shorter spans are stored like the rest.
+ */
+static size_t
+ring_sound(const float *p, const struct silence_kernel *k,
+	float level, int nports, size_t frames)
+{
+	size_t n = frames * nports, pos = 0, i, q;
+
+	while (pos < n) {
+		/* the first frame that may be quiet */
+		i = pos + k->loud(p + pos, n - pos, level);
+		i = (i + nports - 1) / nports * nports;
+		if (i >= n)
+			break;
+		q = k->quiet(p + i, n - i, level);
+		if (q / nports >= SILENCE_FRAMES)
+			return (i / nports);
+		pos = i + q;
+	}
+	return (frames);
+}
+
+/*
+ * Write a chunk with no payload at off, after the pending chunks: frames
+ * frames of silence (-S), or with CHUNK_GAP of a gap in the capture.
+ * Returns where the next chunk goes.
+ */
+static off_t
+blank_put(struct workers *w, struct zjob *zj, struct stage *st,
+	struct capfile *cf, int *pending, off_t off, size_t frames, int flags)
+{
+	for (; *pending > 0; (*pending)--)
+		off += zjob_put(w, zj, st, cf, off);
+	if (st->failed != -1)		/* the file ends before here */
+		return (off);
+	if (chunk_room(cf, off, 0) == 0) {
+		stage_drain(st);
+		cf->written = off;
+		capfile_rotate(cf);
+		off = cf->written;
+	}
+	return (off + chunk_put(st, cf, 0, frames, CHUNK_SILENT | flags, off));
+}
+
+/*
+ * Chunked version of the disk_write loop (-k).
+ *
+ * Each staging buffer holds one chunk: its header, then data copied out of
+ * the ringbuffer until the chunk is full.  Chunks hold whole frames, and
+ * with O_DIRECT each is padded to the alignment.  capfile_close writes the
+ * index of the chunks after the last one.
+ *
+ * With -z the data goes to the raw buffer of the staging buffer the chunk
+ * will be written from, and a worker encodes it into the staging buffer.
+ * pending chunks, starting at st.cur, are with the workers; they are
+ * written in order as they finish, so the file is the same whatever order
+ * the workers finish in.  Until then their size is not known, so with -m
+ * they are counted at their largest.
+ *
+ * With -S, before taking data each time round, the start of the ringbuffer
+ * is scanned for silence.  A quiet span long enough to elide ends the chunk
+ * being filled, then is dropped from the ringbuffer and counted in quiet
+ * until sound starts again, when a CHUNK_SILENT record of it is written.
+ * Otherwise the chunk takes the frames up to the next such span.
+ *
+ * A gap the callback queued ends the chunk before it in the same way, and
+ * is written as a silent chunk with CHUNK_GAP once the frames before it
+ * are.  taken counts the frames that came out of the ringbuffer, which is
+ * where the gaps are counted from.
+ */
+static void
+disk_write_chunked(struct config *c, struct capfile *cf)
+{
+	struct file_header *h = &c->header;
+	size_t framesize = header_frame_size(h);
+	struct stage st;
+	struct workers w;
+	struct zjob *zj;
+	struct convert cv;
+	const struct silence_kernel *sk;
+	char *p;
+	int stopping, pending, slot, cut, i;
+	size_t fill, room, available, stored, l, reserved, want;
+	size_t rframe = h->channels * sizeof(jack_default_audio_sample_t);
+	size_t frames, quiet, q;
+	uint64_t taken;
+	struct gap *g;
+	unsigned int seq;
+	off_t off;
+
+	if (stage_init(&st, c, chunk_stride(h, c->compress ?
+	    codec_bound(h->chunk) : h->chunk),
+	    c->compress ? 2 * c->zthreads + 2 : 0) == -1)
+		return;
+	convert_init(&cv, c);
+	zj = calloc(st.nbuf, sizeof(struct zjob));
+	for (i=0; i < st.nbuf; i++) {
+		zj[i].j.run = zjob_encode;
+		zj[i].out = st.pool[i].buf + CHUNK_HDR_LEN;
+		zj[i].raw = c->compress ? malloc(h->chunk) : zj[i].out;
+		zj[i].channels = h->channels;
+	}
+	if (c->compress) {
+		workers_start(&w, c->zthreads);
+		printf("chunks of %d bytes, %d staging buffers, %d compression threads\n",
+			h->chunk, st.nbuf, c->zthreads);
+	} else {
+		printf("chunks of %d bytes, %d staging buffers\n", h->chunk,
+			st.nbuf);
+	}
+	sk = silence_select();
+	if (c->elide)
+		printf("silence at or below %g elided, scanned by %s\n",
+			c->level, sk->name);
+
+	off = cf->written;		/* just past the header */
+	fill = 0;
+	room = 0;			/* no chunk started */
+	pending = 0;
+	reserved = 0;			/* largest size of the pending chunks */
+	slot = st.cur;
+	quiet = 0;			/* frames of silence dropped so far */
+	taken = 0;
+
+	for (;;) {
+		/* write the compressed chunks that are done, in order */
+		while (pending > 0 && workers_done(&w, &zj[st.cur].j)) {
+			reserved -= chunk_stride(h, zj[st.cur].len);
+			off += zjob_put(&w, zj, &st, cf, off);
+			pending--;
+		}
+		stage_reap(&st, 0);
+		capfile_written(cf, stage_done(&st, off));
+		if (st.failed != -1)
+			break;
+
+		/* when stopping, everything left in the ring is written */
+		stopping = status.stop;
+		seq = wakeup_prepare(&disk_wakeup);
+		available = ring_fill(buffer);
+		stored = convert_stored(&cv, available);
+		if (stopping && stored == 0)
+			break;
+		if (!stopping && available < c->wakeup &&
+		    stored < h->chunk - fill) {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+			continue;
+		}
+
+		frames = available / rframe;
+		want = stored;
+		cut = 0;
+		g = gap_peek();
+		if (g != NULL && g->at <= taken) {
+			if (fill > 0) {
+				want = 0;	/* end the chunk first */
+				cut = 1;
+			} else {
+				if (quiet > 0)
+					off = blank_put(&w, zj, &st, cf,
+						&pending, off, quiet, 0);
+				off = blank_put(&w, zj, &st, cf, &pending,
+					off, g->frames, CHUNK_GAP);
+				gap_pop();
+				reserved = 0;
+				slot = st.cur;
+				quiet = 0;
+				continue;
+			}
+		} else if (g != NULL && g->at - taken < frames) {
+			frames = g->at - taken;
+			want = frames * framesize;
+			cut = 1;
+		}
+
+		if (c->elide && want > 0) {
+			ring_peek(buffer, frames * rframe, &p);
+			q = sk->quiet((float *)p, frames * h->channels,
+				c->level) / h->channels;
+			if (q > 0 && (quiet > 0 || q >= SILENCE_FRAMES)) {
+				if (fill > 0) {
+					want = 0;	/* end the chunk first */
+					cut = 1;
+				} else {
+					if (q > SILENCE_MAX - quiet)
+						q = SILENCE_MAX - quiet;
+					ring_consume(buffer,
+						q * rframe);
+					quiet += q;
+					taken += q;
+					status.silent_bytes += q * framesize;
+					if (q < frames || quiet == SILENCE_MAX) {
+						off = blank_put(&w, zj, &st, cf,
+							&pending, off, quiet, 0);
+						reserved = 0;
+						slot = st.cur;
+						quiet = 0;
+					}
+					continue;
+				}
+			} else {
+				if (quiet > 0) {
+					off = blank_put(&w, zj, &st, cf,
+						&pending, off, quiet, 0);
+					reserved = 0;
+					slot = st.cur;
+					quiet = 0;
+				}
+				l = ring_sound((float *)p, sk, c->level,
+					h->channels, frames);
+				if (l < frames) {
+					want = l * framesize;
+					cut = 1;
+				}
+			}
+		}
+
+		if (room == 0 &&
+		    (room = chunk_room(cf, off + reserved, pending)) == 0) {
+			/* the file is full once the pending chunks are in */
+			for (; pending > 0; pending--)
+				off += zjob_put(&w, zj, &st, cf, off);
+			reserved = 0;
+			stage_drain(&st);
+			if (st.failed != -1)
+				break;
+			cf->written = off;
+			capfile_rotate(cf);
+			off = cf->written;
+			room = chunk_room(cf, off, 0);
+		}
+
+		l = room - fill;
+		if (l > want)
+			l = want;
+		ring_encode(&cv, zj[slot].raw + fill, l);
+		fill += l;
+		taken += l / framesize;
+		if (fill < room && !(cut && l == want))
+			continue;
+
+		if (!c->compress) {
+			off += chunk_put(&st, cf, fill, fill / framesize, 0, off);
+		} else {
+			/* the staging buffer may still be being written */
+			while (st.pool[slot].busy)
+				stage_reap(&st, 1);
+			zj[slot].len = fill;
+			workers_post(&w, &zj[slot].j);
+			reserved += chunk_stride(h, fill);
+			pending++;
+		}
+		slot = (st.cur + pending) % st.nbuf;
+		fill = 0;
+		room = 0;
+		if (pending == st.nbuf)		/* all are with the workers */
+			workers_wait(&w, &zj[st.cur].j);
+	}
+
+	if (fill > 0) {
+		zj[slot].len = fill;
+		if (c->compress) {
+			while (st.pool[slot].busy)
+				stage_reap(&st, 1);
+			workers_post(&w, &zj[slot].j);
+			pending++;
+		} else {
+			off += chunk_put(&st, cf, fill, fill / framesize, 0, off);
+		}
+	}
+	if (quiet > 0)
+		off = blank_put(&w, zj, &st, cf, &pending, off, quiet, 0);
+	/* gaps after the last frames */
+	while ((g = gap_peek()) != NULL) {
+		off = blank_put(&w, zj, &st, cf, &pending, off, g->frames,
+			CHUNK_GAP);
+		gap_pop();
+	}
+	for (; pending > 0; pending--)
+		off += zjob_put(&w, zj, &st, cf, off);
+	stage_drain(&st);
+	cf->written = stage_done(&st, off);
+	stage_exit(&st);
+	if (c->compress) {
+		workers_stop(&w);
+		for (i=0; i < st.nbuf; i++)
+			free(zj[i].raw);
+	}
+	free(zj);
+}
+
+/*
+ * Fill in c->header for capture files.  The port names are the ports
+ * connected to, or with -n jack_cat's own.  -z and -S make the file
+ * chunked.
+ */
+static void
+capture_header(struct config *c)
+{
+	struct file_header *h = &c->header;
+	size_t framesize;
+	char *name;
+	int i;
+
+	memset(h, 0, sizeof(struct file_header));
+	h->version = FORMAT_VERSION;
+	h->channels = c->ports;
+	h->format = c->format;
+	if ((c->compress || c->elide) && c->chunk == 0)
+		c->chunk = ZCHUNK;
+	if (c->compress)
+		h->codec = CODEC_XOR;
+	if (c->chunk > 0) {
+		framesize = header_frame_size(h);
+		h->chunk = c->chunk - c->chunk % framesize;
+		if (h->chunk == 0)
+			h->chunk = framesize;
+		h->align = c->direct ? DIRECT_ALIGN : 1;
+	}
+	h->names = calloc(c->ports, sizeof(char *));
+	for (i=0; i < c->ports; i++) {
+		if (c->connect != NULL) {
+			h->names[i] = c->connect[i];
+		} else {
+			name = malloc(MAX_NAME * 2);
+			snprintf(name, MAX_NAME * 2, "%s:%d",
+				c->jackname != NULL ? c->jackname : "jack_cat", i);
+			h->names[i] = name;
+		}
+	}
+}
+
+/*
+ * Thread to write data from buffer to disk.
+ *
+ * When there is less than the wakeup threshold of data to write, it sleeps on
+ * disk_wakeup, expecting a wakeup from the jack callback handler.
+ *
+ * I/O size is limited to avoid having one long (slow) write block emptying
+ * the buffer.  The ringbuffer is mapped twice over, so data that wraps
+ * around its end still goes to the kernel in one pwrite.
+ *
+ * With -q, writes go through io_uring (disk_write_uring) when the kernel
+ * has it; this loop is the fallback.  -D and -f use disk_write_direct
+ * instead, and chunked files (-k, -z) disk_write_chunked.
+ */
+void
+disk_write(void *arg)
+{
+	struct config *c;
+	int n;
+	size_t available, l, max, done;
+	ssize_t w;
+	unsigned int seq;		/* disk_wakeup sequence */
+	char *p;
+	int stopping;
+	struct capfile cf;		/* the file being written */
+	struct rotation rot;		/* -m file rotation */
+	char *label;			/* encoded file header */
+
+	c = (struct config*)arg;
+	printf("disk_write %s\n", c->filename);
+	capture_header(c);
+	n = header_size(&c->header);
+	if (posix_memalign((void **)&label, FORMAT_ALIGN, n) != 0) {
+		status.stop = 1;
+		return;
+	}
+	header_encode(&c->header, label);
+
+	if (c->direct) {
+		if (capfile_start(&cf, &rot, c, O_TRUNC|O_WRONLY|O_DIRECT,
+		    label, n) == 0) {
+			if (c->header.chunk > 0)
+				disk_write_chunked(c, &cf);
+			else
+				disk_write_direct(c, &cf);
+			capfile_finish(&cf);
+			pthread_exit(NULL);
+		}
+		fprintf(stderr, "O_DIRECT open of %s failed (%s), using the page cache\n",
+			c->filename, strerror(errno));
+	}
+
+	/* Open the file and write a header */
+	if (capfile_start(&cf, &rot, c, O_TRUNC|O_RDWR, label, n) == -1) {
+		fprintf(stderr, "Cannot create file %s\n", c->filename);
+		perror("create");
+		status.stop = 1;
+		return;
+	}
+
+	if (c->header.chunk > 0) {
+		disk_write_chunked(c, &cf);
+		capfile_finish(&cf);
+		pthread_exit(NULL);
+	}
+
+	/* converting to another format needs a staging buffer */
+	if (c->header.format != FORMAT_FLOAT32) {
+		disk_write_direct(c, &cf);
+		capfile_finish(&cf);
+		pthread_exit(NULL);
+	}
+
+	if (c->qdepth > 0 && disk_write_uring(c, &cf) == 0) {
+		capfile_finish(&cf);
+		pthread_exit(NULL);
+	}
+
+	for (;;) {
+		gaps_log(c);
+
+		/* when stopping, everything left in the ring is written */
+		stopping = status.stop;
+		seq = wakeup_prepare(&disk_wakeup);
+		available = ring_fill(buffer);
+		if (available >= c->wakeup || (stopping && available > 0)) {
+			/* This writes data directly from the ringbuffer.  */
+			l = ring_peek(buffer, available, &p);
+			if (capfile_full(&cf, cf.written))
+				capfile_rotate(&cf);
+			/* limit writes to blocksize, and to the end of the file */
+			max = capfile_room(&cf, cf.written, c->blocksize);
+			if (l > max)
+				l = max;
+			if (ring_wraps(p, l))
+				status.disk_wrapped++;
+			status.disk_io++;
+			status.disk_bytes += l;
+			capfile_reserve(&cf, cf.written + l);
+			for (done = 0; done < l; done += w) {
+				w = pwrite(cf.fd, p + done, l - done,
+					cf.written + done);
+				if (w == -1 && (errno == EINTR ||
+				    errno == EAGAIN)) {
+					w = 0;
+					continue;
+				}
+				if (w <= 0)
+					break;
+			}
+			capfile_written(&cf, cf.written + done);
+			if (done < l) {
+				/* the rest stays in the ring */
+				fprintf(stderr, "pwrite(%ld): %s, stopping\n",
+					l - done, w == 0 ? "nothing written" :
+					strerror(errno));
+				status.stop = 1;
+				break;
+			}
+			ring_consume(buffer, l);
+		} else if (stopping) {
+			break;
+		} else {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+		}
+	}
+
+	capfile_finish(&cf);
+	pthread_exit(NULL);
+}
+
+/*
+ * Playback readahead.
+ *
+ * The kernel is told the file is read sequentially, and readahead is
+ * started explicitly for a window ahead of the read offset, sized to
+ * RA_SECONDS of data at the jack sample rate.  Filesystems whose own
+ * readahead is small (FUSE, overlay) otherwise keep the disk thread
+ * waiting on every read with wide files.  Whenever the ringbuffer is less
+ * than a quarter full the window doubles, up to RA_MAX_SECONDS of data;
+ * it grows at most once per window read so one slow read does not blow
+ * it up.
+ */
+struct readahead {
+	int fd;
+	off_t next;		/* readahead started up to here */
+	off_t grown;		/* read offset when the window last grew */
+	size_t window;		/* bytes to keep ahead of the read offset */
+	size_t max;		/* largest window */
+	int rate;		/* sample rate the window is sized for */
+};
+
+static void
+readahead_init(struct readahead *ra, int fd, off_t off, struct config *c)
+{
+	ra->fd = fd;
+	ra->next = off;
+	ra->grown = off;
+	ra->window = 4 * (size_t)c->blocksize;
+	ra->max = ra->window;
+	ra->rate = 0;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	status.ra_window = ra->window;
+}
+
+/* About to read at off, with fill bytes waiting in the ringbuffer */
+static void
+readahead_advance(struct readahead *ra, struct config *c, off_t off,
+	size_t fill)
+{
+	size_t rate;
+
+	/* size the window once jack has told us the sample rate */
+	if (ra->rate == 0 && c->rate > 0) {
+		ra->rate = c->rate;
+		rate = header_frame_size(&c->header) * (size_t)ra->rate;
+		if (ra->window < rate * RA_SECONDS)
+			ra->window = rate * RA_SECONDS;
+		ra->max = rate * RA_MAX_SECONDS;
+	}
+	if (fill < buffer->size / 4 && ra->window < ra->max &&
+	    off - ra->grown >= ra->window) {
+		ra->window *= 2;
+		if (ra->window > ra->max)
+			ra->window = ra->max;
+		ra->grown = off;
+	}
+	status.ra_window = ra->window;
+
+	/* top the window up once half of it has been used */
+	if (ra->next < off)
+		ra->next = off;
+	if (ra->next - off < ra->window / 2) {
+		readahead(ra->fd, ra->next, off + ra->window - ra->next);
+		ra->next = off + ra->window;
+	}
+}
+
+/*
+ * io_uring version of the disk_read loop: read-ahead.
+ *
+ * Up to qdepth block-sized reads are kept outstanding into the free space
+ * ahead of the ringbuffer write pointer, each at its own file offset.  They
+ * may complete in any order, but the write pointer is only advanced over
+ * them in file order, so jack never sees a hole.  A read that reaches the
+ * end of the file, or fails, ends playback once everything before it is
+ * committed; an interrupted one is queued again.
+ *
+ * Returns -1 without reading anything if io_uring cannot be used.
+ */
+static int
+disk_read_uring(struct config *c, int fd)
+{
+	struct uring u;
+	struct uring_req *req, *r;
+	struct io_uring_cqe *cqe;
+	struct readahead ra;
+	int head = 0, count = 0;	/* FIFO of requests in flight */
+	size_t inflight = 0;		/* bytes in flight */
+	size_t available;
+	unsigned int seq;
+	char *p;
+	off_t off;
+	int err, slot, eof = 0;
+
+	if ((err = uring_init(&u, c->qdepth)) < 0) {
+		fprintf(stderr, "io_uring unavailable (%s), using read\n",
+			strerror(-err));
+		return (-1);
+	}
+	req = calloc(c->qdepth, sizeof(struct uring_req));
+	off = lseek(fd, 0, SEEK_CUR);	/* just past the header */
+	readahead_init(&ra, fd, off, c);
+	status.uring = 1;
+
+	for (;;) {
+		/* collect completions */
+		while ((cqe = uring_peek_cqe(&u)) != NULL) {
+			r = &req[cqe->user_data];
+			if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+				uring_queue(&u, IORING_OP_READV, fd, r,
+					cqe->user_data);
+				uring_submit(&u, 0);
+			} else if (cqe->res < 0) {
+				fprintf(stderr, "io_uring read(%ld) = %d\n",
+					r->len - r->done, cqe->res);
+				r->eof = 1;
+			} else if (cqe->res == 0) {
+				r->eof = 1;
+			} else {
+				r->done += cqe->res;
+				if (r->done < r->len) {
+					uring_queue(&u, IORING_OP_READV, fd,
+						r, cqe->user_data);
+					uring_submit(&u, 0);
+				}
+			}
+			if (r->done == r->len || r->eof)
+				uring_latency(r);
+			uring_cqe_seen(&u);
+		}
+
+		/*
+		 * Commit the oldest reads, in file order.  The data ends with
+		 * a read that came up short; the ones after it are dropped.
+		 */
+		while (count > 0 && (req[head].done == req[head].len ||
+		    req[head].eof)) {
+			if (!eof) {
+				ring_commit(buffer, req[head].done);
+				status.disk_bytes += req[head].done;
+				eof = req[head].eof;
+			}
+			inflight -= req[head].len;
+			head = (head + 1) % c->qdepth;
+			count--;
+		}
+		status.disk_inflight = count;
+
+		if (status.stop || eof) {
+			if (count == 0)
+				break;
+			uring_wait_cqe(&u, &cqe);
+			continue;
+		}
+
+		seq = wakeup_prepare(&disk_wakeup);
+		available = ring_space(buffer) - inflight;
+		if (count < c->qdepth && available >= c->wakeup) {
+			slot = (head + count) % c->qdepth;
+			r = &req[slot];
+			ring_reserve(buffer, inflight + available, &p);
+			r->buf = p + inflight;
+			r->len = available < c->blocksize ?
+				available : c->blocksize;
+			r->done = 0;
+			r->eof = 0;
+			r->off = off;
+			readahead_advance(&ra, c, off,
+				ring_fill(buffer));
+			r->submitted = now_ns();
+			off += r->len;
+			inflight += r->len;
+			count++;
+			status.disk_io++;
+			uring_queue(&u, IORING_OP_READV, fd, r, slot);
+			uring_submit(&u, 0);
+		} else if (count > 0) {
+			uring_wait_cqe(&u, &cqe);
+		} else {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+		}
+	}
+
+	if (eof) {
+		fprintf(stderr, "read() = EOF\n");
+		status.eof = 1;
+	}
+	status.disk_inflight = 0;
+	free(req);
+	uring_exit(&u);
+	return (0);
+}
+
+/*
+ * -M version of the disk_read loop: instead of reading into the ringbuffer,
+ * keep up to rbsize of the file mapping ahead of the play position
+ * resident, in blocksize steps.  Each block is locked into memory, or if
+ * that is not allowed, faulted in by touching every page, before the
+ * callback is told about it.  Pages the callback has finished with are
+ * unlocked and dropped.
+ *
+ * Returns -1 if the file cannot be mapped.
+ */
+static int
+disk_read_mmap(struct config *c, int fd)
+{
+	struct playmap *pm = &playmap;
+	struct stat st;
+	size_t framesize, pagesize, pos, space, l, lo, hi, dropped;
+	off_t hlen;
+	unsigned int seq;
+	int lock = 1;
+
+	framesize = c->ports * sizeof(jack_default_audio_sample_t);
+	pagesize = sysconf(_SC_PAGESIZE);
+	hlen = lseek(fd, 0, SEEK_CUR);	/* just past the header */
+	if (fstat(fd, &st) == -1 || st.st_size <= hlen) {
+		fprintf(stderr, "cannot map %s, using read\n", c->filename);
+		return (-1);
+	}
+	pm->maplen = st.st_size;
+	pm->map = mmap(NULL, pm->maplen, PROT_READ, MAP_SHARED, fd, 0);
+	if (pm->map == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s, using read\n", strerror(errno));
+		pm->map = NULL;
+		return (-1);
+	}
+	madvise(pm->map, pm->maplen, MADV_SEQUENTIAL);
+	pm->data = pm->map + hlen;
+	pm->len = (st.st_size - hlen) / framesize * framesize;
+	pm->ready = 0;
+	pm->pos = 0;
+	dropped = 0;
+	printf("mmap playback: %ld bytes\n", pm->len);
+	__atomic_store_n(&pm->state, PLAYMAP_ACTIVE, __ATOMIC_RELEASE);
+
+	while (status.stop == 0) {
+		seq = wakeup_prepare(&disk_wakeup);
+		pos = __atomic_load_n(&pm->pos, __ATOMIC_ACQUIRE);
+
+		/* let go of the pages before the play position */
+		lo = (hlen + dropped) & ~(pagesize - 1);
+		hi = (hlen + pos) & ~(pagesize - 1);
+		if (hi > lo && hi - lo >= c->blocksize) {
+			if (lock)
+				munlock(pm->map + lo, hi - lo);
+			madvise(pm->map + lo, hi - lo, MADV_DONTNEED);
+			dropped = hi - hlen;
+		}
+
+		space = c->rbsize - (pm->ready - pos);
+		if (pm->ready < pm->len && (space >= c->wakeup ||
+		    pm->len - pm->ready <= space)) {
+			l = space;
+			if (l > c->blocksize)	/* limit to blocksize */
+				l = c->blocksize;
+			if (l > pm->len - pm->ready)
+				l = pm->len - pm->ready;
+			lo = (hlen + pm->ready) & ~(pagesize - 1);
+			hi = hlen + pm->ready + l;
+			madvise(pm->map + lo, hi - lo, MADV_WILLNEED);
+			if (lock && mlock(pm->map + lo, hi - lo) == -1) {
+				fprintf(stderr, "mlock: %s, prefaulting only\n",
+					strerror(errno));
+				lock = 0;
+			}
+			if (!lock) {
+				for (; lo < hi; lo += pagesize)
+					(void)*(volatile char *)(pm->map + lo);
+			}
+			status.disk_io++;
+			status.disk_bytes += l;
+			__atomic_store_n(&pm->ready, pm->ready + l,
+				__ATOMIC_RELEASE);
+		} else {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+		}
+	}
+
+	/* the callback may still be running; stop_io unmaps the file */
+	return (0);
+}
+
+/*
+ * Check the CRC of chunk k, given crc, the CRC of its header continued
+ * over its payload as it was read.  A chunk that does not match is
+ * counted and reported, but still played.
+ */
+static void
+chunk_check(struct chunk *k, uint32_t crc)
+{
+	status.crc_chunks++;
+	if (crc == k->crc)
+		return;
+	status.crc_errors++;
+	fprintf(stderr, "chunk at frame %ld has a bad CRC\n", (long)k->frame);
+}
+
+/* Put len bytes of silence, which is not stored (-S), in the ringbuffer */
+static void
+ring_zero(size_t len)
+{
+	char *p;
+
+	ring_reserve(buffer, len, &p);
+	memset(p, 0, len);
+	ring_commit(buffer, len);
+}
+
+/*
+ * Chunked version of the disk_read loop.
+ *
+ * The chunks are found through the index.  Each chunk header is read on
+ * its own, then the payload straight into the ringbuffer, in blocksize
+ * pieces as space allows.  Silent chunks (-S) are zeros, with no read.
+ * The CRC is worked out as the pieces come in, and checked at the end of
+ * the chunk; not for the first one if -s starts part way into it.
+ */
+static void
+disk_read_chunked(struct config *c, int fd)
+{
+	struct chunk_index *x = &c->index;
+	struct readahead ra;
+	char hdr[CHUNK_HDR_LEN];
+	struct chunk k;
+	size_t i, got, len, available, l;
+	size_t framesize = header_frame_size(&c->header);
+	unsigned int seq;
+	uint32_t crc;
+	ssize_t r;
+	char *p;
+	off_t off;
+	int check, loaded = 0;
+
+	i = c->chunk_first;
+	readahead_init(&ra, fd, i < x->n ? x->e[i].off : 0, c);
+
+	while (status.stop == 0) {
+		if (!loaded) {
+			if (i == x->n) {
+				fprintf(stderr, "end of chunks\n");
+				status.eof = 1;
+				break;
+			}
+			off = x->e[i].off;
+			if (pread(fd, hdr, CHUNK_HDR_LEN, off) != CHUNK_HDR_LEN ||
+			    chunk_decode(&k, hdr) == -1) {
+				fprintf(stderr, "bad chunk at %ld\n", (long)off);
+				status.eof = 1;
+				break;
+			}
+			off += CHUNK_HDR_LEN;
+			len = k.len;
+			if (k.flags & CHUNK_SILENT)
+				len = (size_t)k.frames * framesize;
+			if (k.flags & CHUNK_GAP) {
+				status.gaps++;
+				status.gap_frames += k.frames;
+			}
+			got = 0;
+			if (i == c->chunk_first)
+				got = c->chunk_skip < len ? c->chunk_skip : len;
+			check = (k.flags & CHUNK_CRC) && got == 0;
+			crc = crc32c(0, hdr, CHUNK_CRC_OFF);
+			loaded = 1;
+		}
+		if (got == len) {
+			if (check)
+				chunk_check(&k, crc);
+			i++;
+			loaded = 0;
+			continue;
+		}
+
+		seq = wakeup_prepare(&disk_wakeup);
+		available = ring_space(buffer);
+		if (k.flags & CHUNK_SILENT && available > 0) {
+			l = len - got;
+			if (l > available)
+				l = available;
+			ring_zero(l);
+			status.silent_bytes += l;
+			got += l;
+		} else if (available >= c->wakeup || available >= len - got) {
+			ring_reserve(buffer, available, &p);
+			l = len - got;
+			if (l > c->blocksize)	/* limit reads to blocksize */
+				l = c->blocksize;
+			if (l > available)
+				l = available;
+			readahead_advance(&ra, c, off + got,
+				ring_fill(buffer));
+			status.disk_io++;
+			r = pread(fd, p, l, off + got);
+			if (r <= 0) {
+				fprintf(stderr, "chunk read = %ld\n", r);
+				status.eof = 1;
+				break;
+			}
+			if (check)
+				crc = crc32c(crc, p, r);
+			ring_commit(buffer, r);
+			status.disk_bytes += r;
+			got += r;
+		} else {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+		}
+	}
+}
+
+/*
+ * A chunk being decoded for playback.  The payload of a CHUNK_CODED chunk
+ * is read into in and a worker decodes it into out; the others are read
+ * straight into out.
+ */
+struct unzjob {
+	struct job j;
+	struct chunk k;
+	int silent;		/* CHUNK_SILENT: no payload, out not used */
+	char *in;		/* payload as stored */
+	char *out;		/* frames */
+	size_t len;		/* bytes of frames */
+	size_t got;		/* bytes of them in the ringbuffer */
+	int channels;
+	int err;		/* the payload did not decode */
+	int checked;		/* err and us have been looked at */
+	long us;		/* time it took */
+};
+
+static void
+unzjob_decode(struct job *j)
+{
+	struct unzjob *z = (struct unzjob *)j;
+	long start = now_ns();
+
+	z->err = codec_decode((float *)z->out, z->in, z->k.len, z->k.frames,
+		z->channels);
+	z->us = (now_ns() - start) / 1000;
+}
+
+/*
+ * Read chunk i of the index into z, check its CRC, and hand it to a worker
+ * if it needs decoding; a silent one needs neither.  Returns -1 if it is
+ * not a good chunk.
+ */
+static int
+unzjob_read(struct config *c, int fd, size_t i, struct unzjob *z,
+	struct workers *w, struct readahead *ra)
+{
+	struct file_header *h = &c->header;
+	size_t framesize = header_frame_size(h);
+	char hdr[CHUNK_HDR_LEN];
+	off_t off = c->index.e[i].off;
+	uint32_t crc;
+	int check;
+
+	readahead_advance(ra, c, off, ring_fill(buffer));
+	if (pread(fd, hdr, CHUNK_HDR_LEN, off) != CHUNK_HDR_LEN ||
+	    chunk_decode(&z->k, hdr) == -1 || z->k.len > h->chunk)
+		return (-1);
+	z->silent = (z->k.flags & CHUNK_SILENT) != 0;
+	if (z->k.flags & CHUNK_GAP) {
+		status.gaps++;
+		status.gap_frames += z->k.frames;
+	}
+	if (!z->silent && (size_t)z->k.frames * framesize > h->chunk)
+		return (-1);
+	z->len = (size_t)z->k.frames * framesize;
+	z->got = 0;
+	z->checked = 0;
+	if (i == c->chunk_first)
+		z->got = c->chunk_skip < z->len ? c->chunk_skip : z->len;
+	check = z->k.flags & CHUNK_CRC;
+	crc = crc32c(0, hdr, CHUNK_CRC_OFF);
+	if (z->silent) {
+		if (check)
+			chunk_check(&z->k, crc);
+		z->err = 0;
+		z->us = 0;
+		z->j.done = 1;
+		return (0);
+	}
+	status.disk_io++;
+	status.disk_bytes += z->k.len;
+	if (!(z->k.flags & CHUNK_CODED)) {
+		if (z->k.len != z->len ||
+		    pread(fd, z->out, z->len, off + CHUNK_HDR_LEN) != z->len)
+			return (-1);
+		if (check)
+			chunk_check(&z->k, crc32c(crc, z->out, z->len));
+		z->err = 0;
+		z->us = 0;
+		z->j.done = 1;
+		return (0);
+	}
+	if (pread(fd, z->in, z->k.len, off + CHUNK_HDR_LEN) != z->k.len)
+		return (-1);
+	if (check)
+		chunk_check(&z->k, crc32c(crc, z->in, z->k.len));
+	workers_post(w, &z->j);
+	return (0);
+}
+
+/*
+ * Version of disk_read_chunked for files with compressed chunks (-z), or
+ * samples that are not floats (-f).
+ *
+ * Up to nslot chunks are read ahead and decoded by the workers, each on
+ * its own, while the oldest is copied (and converted) into the ringbuffer.
+ */
+static void
+disk_read_decode(struct config *c, int fd)
+{
+	struct chunk_index *x = &c->index;
+	struct file_header *h = &c->header;
+	struct readahead ra;
+	struct workers w;
+	struct unzjob *zj, *z;
+	struct convert cv;
+	size_t i, available, room, l;
+	unsigned int seq;
+	int nslot, head, n;
+
+	nslot = 2 * c->zthreads + 2;
+	zj = calloc(nslot, sizeof(struct unzjob));
+	for (n=0; n < nslot; n++) {
+		zj[n].j.run = unzjob_decode;
+		zj[n].in = malloc(h->chunk);
+		zj[n].out = malloc(h->chunk);
+		zj[n].channels = h->channels;
+	}
+	workers_start(&w, c->zthreads);
+	convert_init(&cv, c);
+	if (h->codec != CODEC_NONE)
+		printf("decoding with %d threads, %d chunks ahead\n",
+			c->zthreads, nslot);
+
+	i = c->chunk_first;
+	readahead_init(&ra, fd, i < x->n ? x->e[i].off : 0, c);
+	head = 0;
+	n = 0;				/* chunks read ahead */
+
+	while (status.stop == 0) {
+		/* keep the workers busy */
+		if (n < nslot && i < x->n) {
+			if (unzjob_read(c, fd, i, &zj[(head + n) % nslot], &w,
+			    &ra) == -1) {
+				fprintf(stderr, "bad chunk at %ld\n",
+					(long)x->e[i].off);
+				x->n = i;	/* play up to it */
+			} else {
+				i++;
+				n++;
+			}
+			continue;
+		}
+		if (n == 0) {
+			fprintf(stderr, "end of chunks\n");
+			status.eof = 1;
+			break;
+		}
+		z = &zj[head];
+		if (z->got == z->len) {
+			head = (head + 1) % nslot;
+			n--;
+			continue;
+		}
+
+		seq = wakeup_prepare(&disk_wakeup);
+		available = ring_space(buffer);
+		room = convert_room(&cv, available);
+		if (room > 0 &&
+		    (available >= c->wakeup || room >= z->len - z->got)) {
+			if (!z->checked) {
+				workers_wait(&w, &z->j);
+				z->checked = 1;
+				if (z->err) {
+					fprintf(stderr, "chunk at frame %ld does not decode\n",
+						(long)z->k.frame);
+					status.eof = 1;
+					break;
+				}
+				if (z->k.flags & CHUNK_CODED) {
+					status.raw_bytes += z->len;
+					status.coded_bytes += z->k.len;
+					status.codec_us += (z->us -
+					    status.codec_us) / 16;
+					if (z->us > status.codec_us_max)
+						status.codec_us_max = z->us;
+				}
+			}
+			l = z->len - z->got;
+			if (l > room)
+				l = room;
+			if (z->silent) {
+				ring_zero(l / cv.k->size * sizeof(float));
+				status.silent_bytes += l;
+			} else {
+				ring_decode(&cv, z->out + z->got, l);
+			}
+			z->got += l;
+		} else {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+		}
+	}
+
+	/* the workers finish what they were given before they stop */
+	workers_stop(&w);
+	for (n=0; n < nslot; n++) {
+		free(zj[n].in);
+		free(zj[n].out);
+	}
+	free(zj);
+}
+
+/*
+ * Version of the disk_read loop for flat files of samples that are not
+ * floats (-f).  Blocks are read into a buffer and converted from there
+ * into the ringbuffer.
+ */
+static void
+disk_read_convert(struct config *c, int fd)
+{
+	struct readahead ra;
+	struct convert cv;
+	size_t len, got, available, room, l;
+	unsigned int seq;
+	ssize_t r;
+	off_t off;
+	char *buf;
+
+	buf = malloc(c->blocksize);
+	convert_init(&cv, c);
+	off = lseek(fd, 0, SEEK_CUR);
+	readahead_init(&ra, fd, off, c);
+	len = got = 0;
+
+	while (status.stop == 0) {
+		if (got == len) {
+			readahead_advance(&ra, c, off,
+				ring_fill(buffer));
+			status.disk_io++;
+			r = pread(fd, buf, c->blocksize, off);
+			if (r <= 0) {
+				fprintf(stderr, "read() = EOF\n");
+				status.eof = 1;
+				break;
+			}
+			status.disk_bytes += r;
+			off += r;
+			len = r;
+			got = 0;
+		}
+
+		seq = wakeup_prepare(&disk_wakeup);
+		available = ring_space(buffer);
+		room = convert_room(&cv, available);
+		if (room > 0 && (available >= c->wakeup || room >= len - got)) {
+			l = len - got;
+			if (l > room)
+				l = room;
+			ring_decode(&cv, buf + got, l);
+			got += l;
+		} else {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+		}
+	}
+	free(buf);
+}
+
+/*
+ * Thread to read data from disk into the buffer
+ *
+ * When there is less than the wakeup threshold of space for data, it sleeps
+ * on disk_wakeup, expecting a wakeup from the jack callback handler.
+ *
+ * With -q, reads go through io_uring (disk_read_uring) when the kernel has
+ * it; this loop is the fallback.  -M uses disk_read_mmap instead, and
+ * chunked files disk_read_chunked, or disk_read_decode if they are
+ * compressed or not floats.  Other files that are not floats use
+ * disk_read_convert.  The read loops keep readahead going in front of them
+ * (struct readahead).
+ */
+void
+disk_read(void *arg)
+{
+	struct config *c;
+	int fd;
+	size_t available, l;
+	ssize_t r;
+	unsigned int seq;		/* disk_wakeup sequence */
+	char *p;
+	struct readahead ra;
+	off_t off;			/* file offset */
+
+	c = (struct config*)arg;
+	fd = c->fd;			/* open_playback read the header */
+	printf("disk_read %s\n", c->filename);
+
+	if (c->header.chunk > 0) {
+		if (c->mmap)
+			fprintf(stderr, "chunked file, not using -M\n");
+		if (c->header.codec != CODEC_NONE ||
+		    c->header.format != FORMAT_FLOAT32)
+			disk_read_decode(c, fd);
+		else
+			disk_read_chunked(c, fd);
+		close(fd);
+		pthread_exit(NULL);
+	}
+
+	if (c->header.format != FORMAT_FLOAT32) {
+		if (c->mmap)
+			fprintf(stderr, "%s samples, not using -M\n",
+				header_format_name(c->header.format));
+		disk_read_convert(c, fd);
+		close(fd);
+		pthread_exit(NULL);
+	}
+
+	if (c->mmap && disk_read_mmap(c, fd) == 0) {
+		close(fd);
+		pthread_exit(NULL);
+	}
+
+	if (c->qdepth > 0 && disk_read_uring(c, fd) == 0) {
+		close(fd);
+		pthread_exit(NULL);
+	}
+
+	off = lseek(fd, 0, SEEK_CUR);
+	readahead_init(&ra, fd, off, c);
+
+	while (status.stop == 0) {
+		seq = wakeup_prepare(&disk_wakeup);
+		available = ring_space(buffer);
+		if (available >= c->wakeup) {
+			/* This writes data directly to the ringbuffer.  */
+			l = ring_reserve(buffer, available, &p);
+			if (l > c->blocksize)	/* limit writes to blocksize */
+				l = c->blocksize;
+			//printf("read(%ld)\n", l);
+			readahead_advance(&ra, c, off,
+				ring_fill(buffer));
+			status.disk_io++;
+			/* at off, so a short read cannot lose track of it */
+			r = pread(fd, p, l, off);
+			if (r > 0) {
+				status.disk_bytes += r;
+				ring_commit(buffer, r);
+				off += r;
+			} else if (r == 0) {
+				fprintf(stderr, "read() = EOF\n");
+				status.eof = 1;
+				break;
+			} else if (errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "read(%ld): %s\n", l,
+					strerror(errno));
+				status.eof = 1;
+				break;
+			}
+		} else {
+			wakeup_wait(&disk_wakeup, seq);
+			status.disk_wakeups++;
+		}
+	}
+
+	close(fd);
+	pthread_exit(NULL);
+}
+
+/*
+ * Open the playback file and check its header against the ports we have,
+ * before jack is started.  The file is left at the first frame to play,
+ * or for a chunked file its index is loaded and the start chunk found.
+ */
+static int
+open_playback(struct config *c)
+{
+	struct file_header *h = &c->header;
+	size_t framesize;
+	uint64_t frame;			/* -s start frame */
+	int i;
+
+	if ((c->fd = open(c->filename, O_RDONLY, 0)) == -1) {
+		perror(c->filename);
+		return (-1);
+	}
+	if (header_read(c->fd, h) == -1) {
+		fprintf(stderr, "cannot read header of %s\n", c->filename);
+		return (-1);
+	}
+	printf("%s: version %d, %d channels %s", c->filename, h->version,
+		h->channels, header_format_name(h->format));
+	if (h->rate != 0)
+		printf(" %d Hz period %d", h->rate, h->period);
+	printf("\n");
+	for (i=0; h->names != NULL && i < h->channels; i++)
+		printf("  %d: %s\n", i, h->names[i]);
+
+	if (h->channels != c->ports) {
+		fprintf(stderr, "%s has %d channels, but there are %d ports\n",
+			c->filename, h->channels, c->ports);
+		return (-1);
+	}
+	if (header_sample_size(h->format) == 0) {
+		fprintf(stderr, "%s: cannot play sample format %d\n",
+			c->filename, h->format);
+		return (-1);
+	}
+
+	if (h->codec != CODEC_NONE && (h->codec != CODEC_XOR || h->chunk == 0)) {
+		fprintf(stderr, "%s: unknown chunk codec %d\n", c->filename,
+			h->codec);
+		return (-1);
+	}
+
+	if (c->start > 0 && h->rate == 0) {
+		fprintf(stderr, "%s does not record its sample rate, -s needs it\n",
+			c->filename);
+		return (-1);
+	}
+	frame = (uint64_t)c->start * h->rate;
+	framesize = header_frame_size(h);
+	if (h->chunk > 0) {
+		/* find the chunk holding the start frame in the index */
+		if (index_read(c->fd, h, &c->index) == -1)
+			return (-1);
+		printf("%ld chunks of up to %d bytes\n", c->index.n, h->chunk);
+		if (c->index.n > 0) {
+			c->chunk_first = index_find(&c->index, frame);
+			if (frame > c->index.e[c->chunk_first].frame)
+				c->chunk_skip = (frame -
+				    c->index.e[c->chunk_first].frame) * framesize;
+		}
+	} else if (frame > 0) {
+		lseek(c->fd, h->len + frame * framesize, SEEK_SET);
+	}
+	return (0);
+}
+
+/*
+ * Chunks [from, to) of the index, for verify_file to check.
+ */
+struct vjob {
+	struct job j;
+	struct config *c;
+	size_t from, to;
+	long bytes;		/* chunk bytes read */
+	int errors;		/* chunks with a bad CRC */
+	int bad;		/* chunks that could not be read */
+	int nocrc;		/* chunks without a CRC */
+};
+
+static void
+vjob_check(struct job *j)
+{
+	struct vjob *v = (struct vjob *)j;
+	struct config *c = v->c;
+	struct chunk_index *x = &c->index;
+	size_t max = CHUNK_HDR_LEN + c->header.chunk, len, i;
+	struct chunk k;
+	char *buf;
+	ssize_t r;
+
+	buf = malloc(max);
+	for (i=v->from; i < v->to; i++) {
+		/* the chunk is all that is up to the next one */
+		len = max;
+		if (i + 1 < x->n && x->e[i + 1].off - x->e[i].off < max)
+			len = x->e[i + 1].off - x->e[i].off;
+		r = pread(c->fd, buf, len, x->e[i].off);
+		if (r < CHUNK_HDR_LEN || chunk_decode(&k, buf) == -1 ||
+		    k.len > c->header.chunk || r < CHUNK_HDR_LEN + k.len ||
+		    k.frame != x->e[i].frame) {
+			fprintf(stderr, "chunk %zu at %ld cannot be read\n", i,
+				(long)x->e[i].off);
+			v->bad++;
+			continue;
+		}
+		v->bytes += CHUNK_HDR_LEN + k.len;
+		if (!(k.flags & CHUNK_CRC)) {
+			v->nocrc++;
+			continue;
+		}
+		if (crc32c(crc32c(0, buf, CHUNK_CRC_OFF), buf + CHUNK_HDR_LEN,
+		    k.len) != k.crc) {
+			fprintf(stderr, "chunk %zu at frame %ld has a bad CRC\n",
+				i, (long)k.frame);
+			v->errors++;
+		}
+	}
+	free(buf);
+}
+
+/*
+ * Check every chunk of a file against its CRC (-V), without jack.  The
+ * chunks are split into ranges, several to a thread so a slow range does
+ * not hold up the end, and checked by -z threads, or one per CPU.
+ * Returns -1 if any chunk is bad.
+ */
+int
+verify_file(struct config *c)
+{
+	struct file_header *h = &c->header;
+	struct chunk_index *x = &c->index;
+	struct workers w;
+	struct vjob *v;
+	int nthreads, njobs, i, errors = 0, bad = 0, nocrc = 0;
+	long bytes = 0, start;
+	double sec;
+
+	if ((c->fd = open(c->filename, O_RDONLY, 0)) == -1) {
+		perror(c->filename);
+		return (-1);
+	}
+	if (header_read(c->fd, h) == -1) {
+		fprintf(stderr, "cannot read header of %s\n", c->filename);
+		return (-1);
+	}
+	if (h->chunk == 0) {
+		fprintf(stderr, "%s is not chunked (-k), it has no CRCs\n",
+			c->filename);
+		return (-1);
+	}
+	if (index_read(c->fd, h, x) == -1)
+		return (-1);
+
+	nthreads = c->compress ? c->zthreads : sysconf(_SC_NPROCESSORS_ONLN);
+	njobs = 4 * (nthreads > 0 ? nthreads : 1);
+	if (njobs > x->n)
+		njobs = x->n > 0 ? x->n : 1;
+	v = calloc(njobs, sizeof(struct vjob));
+	workers_start(&w, nthreads);
+	start = now_ns();
+	for (i=0; i < njobs; i++) {
+		v[i].j.run = vjob_check;
+		v[i].c = c;
+		v[i].from = x->n * i / njobs;
+		v[i].to = x->n * (i + 1) / njobs;
+		workers_post(&w, &v[i].j);
+	}
+	for (i=0; i < njobs; i++) {
+		workers_wait(&w, &v[i].j);
+		bytes += v[i].bytes;
+		errors += v[i].errors;
+		bad += v[i].bad;
+		nocrc += v[i].nocrc;
+	}
+	sec = (now_ns() - start) / 1e9;
+	workers_stop(&w);
+	free(v);
+
+	printf("%s: %zu chunks %ld MB in %.2f s (%.0f MB/s), %d threads, crc32c %s\n",
+		c->filename, x->n, bytes / 1048576, sec,
+		sec > 0 ? bytes / 1048576.0 / sec : 0, nthreads, crc32c_name());
+	printf("crc errors %d unreadable %d without crc %d\n", errors, bad,
+		nocrc);
+	close(c->fd);
+	return (errors > 0 || bad > 0 ? -1 : 0);
+}
+
+/*
+ * Create threads that read/write disk files, open files.
+ */
+void
+start_io(struct config *c)
+{
+	void *func;
 
 	switch (c->io) {
 	case CFG_CAPTURE:	
@@ -609,6 +3840,8 @@ start_io(struct config *c)
 		pthread_create(&disk_thread, NULL, func, c);
 		break;
 	case CFG_PLAYBACK:
+		if (open_playback(c) == -1)
+			exit(1);
 		func = &disk_read;
 		pthread_create(&disk_thread, NULL, func, c);
 		break;
@@ -621,16 +3854,27 @@ start_io(struct config *c)
 /*
  * Wait for I/O threads to end.
  * Assumes that status.stop is set
+ *
+ * The capture thread writes out what is left in the ring buffer and
+ * finishes the file before it exits, so give it time to do that before
+ * resorting to cancelling it.
  */
 void
 stop_io(struct config *c)
 {
-	if(pthread_mutex_trylock(&disk_mutex) == 0) {
-		pthread_cond_signal(&disk_cond);
-		pthread_mutex_unlock(&disk_mutex);
+	struct timespec ts;
+
+	wakeup_post(&disk_wakeup);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 10;
+	if (pthread_timedjoin_np(disk_thread, NULL, &ts) != 0) {
+		fprintf(stderr, "disk thread did not stop, cancelling it\n");
+		pthread_cancel(disk_thread);
+		pthread_join(disk_thread, NULL);
 	}
-	pthread_cancel(disk_thread);
-	pthread_join(disk_thread, NULL);
+	/* jack is closed by now, so nothing is reading the mapping */
+	if (playmap.map != NULL)
+		munmap(playmap.map, playmap.maplen);
 	printf("i/o stopped\n");
 }
 
@@ -646,10 +3890,7 @@ signal_handler()
 	status.stop = 1;
 
 	/* signal disk write code to flush the data it has */
-	if(pthread_mutex_trylock(&disk_mutex) == 0) {
-		pthread_cond_signal(&disk_cond);
-		pthread_mutex_unlock(&disk_mutex);
-	}
+	wakeup_post(&disk_wakeup);
 
 	/* do something stronger on 2nd signal */
 	//pthread_cancel(disk_thread);
@@ -674,21 +3915,39 @@ set_signal_handler()
 void
 usage()
 {
-	printf("jack_cat -c filename | -p filename port(s)\n");
+	printf("jack_cat -c filename | -p filename port(s) | -V filename\n");
 }
 
 void
 help()
 {
-	printf("jack_cat -c filename | -p filename port(s)\n");
+	printf("jack_cat -c filename | -p filename port(s) | -V filename\n");
 	printf("  -c filename    capture to file\n");
 	printf("  -p filename    play back from file\n");
+	printf("  -V filename    check the CRCs of a chunked file\n");
 	printf("  -n count       number of ports (do not auto connect)\n");
  	printf("  -N name        client name to use with jack (default: jack_cat)\n");
 	printf("  -b size        block size to use\n");
-	printf("  -B size        ring buffer size\n");
-	printf("  -m size        maximum file size (for -C)\n");
+	printf("  -B size        ring buffer size, or (-B 30s) seconds of all ports\n");
+	printf("  -w size        wake disk thread at this much data/space\n");
+	printf("  -m size        maximum capture file size (rotates files)\n");
 	printf("  -t time        run for time seconds\n");
+	printf("  -q depth       io_uring queue depth (0: plain read/write)\n");
+	printf("  -D             capture with O_DIRECT (truncates the file)\n");
+	printf("  -W size        capture writeback window (0: leave it to the kernel)\n");
+	printf("  -A size        capture file preallocation chunk (0: none)\n");
+	printf("  -M             play back from a memory mapping of the file\n");
+	printf("  -k size        capture to a chunked file with chunks of size\n");
+	printf("  -s time        start playback time seconds into the file\n");
+	printf("  -z threads     compress chunks with threads worker threads\n");
+	printf("                 (playback: decompress with them, -V: check\n");
+	printf("                 with them)\n");
+	printf("  -f format      capture sample format: float32 (default), int16,\n");
+	printf("                 int24, float16\n");
+	printf("  -d             dither int16 captures\n");
+	printf("  -S level       store runs of samples at or below level (0: only\n");
+	printf("                 zeros) as silence records\n");
+	printf("  -L             lock all memory, the jack callback's included\n");
 
 	printf("  port1 .. portn	names of ports to connect to\n");
 }
@@ -0,0 +1,365 @@
+/*
+ * ring - single producer, single consumer ring buffer of frames
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * One thread (the producer) puts data in, another (the consumer) takes it
+ * out, without locks:
+ *
+ *	n = ring_reserve(r, want, &p);		n = ring_peek(r, want, &p);
+ *	fill up to n bytes at p			use up to n bytes at p
+ *	ring_commit(r, len);			ring_consume(r, len);
+ *
+ * The data is stored before the head is moved past it (a release store),
+ * and the consumer loads the head before looking at the data (an acquire
+ * load); the same goes for the tail and the space in the other direction.
+ *
+ * The ring's memory is a memfd mapped twice, back to back: the byte after
+ * the last of the first mapping is the first of the ring again.  Space and
+ * data never come in two parts at the wrap, so an interleave kernel, a
+ * conversion or a disk transfer is always one call on one buffer.  The
+ * size is rounded up to a whole number of pages, which the mappings need,
+ * and not to a power of two.
+ *
+ * A ring of a huge page or more is put on huge pages, so the jack callback
+ * does not take a TLB miss every few KB of a multi-GB ring: from hugetlbfs
+ * when the administrator has reserved enough of them, otherwise 4K pages
+ * with transparent huge pages asked for (which shmem gives only when
+ * /sys/kernel/mm/transparent_hugepage/shmem_enabled allows).
+ *
+ * ring_prefault faults in every page of both mappings, with a thread per
+ * RING_PREFAULT_MIN bytes up to one per CPU, and ring_lock keeps them in
+ * memory; the callback then never waits for a page.
+ */
+
+#define _GNU_SOURCE		/* memfd_create */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "ring.h"
+
+#define RING_PREFAULT_MIN	(64 << 20)	/* bytes worth a thread */
+#define RING_PREFAULT_MAX	16		/* most threads */
+
+/* The default huge page size, or 0 if there are none */
+static size_t
+ring_huge_size(void)
+{
+	char line[128];
+	size_t kb = 0;
+	FILE *f;
+
+	if ((f = fopen("/proc/meminfo", "r")) == NULL)
+		return (0);
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+			break;
+	fclose(f);
+	return (kb * 1024);
+}
+
+/*
+ * Map size bytes of a new memfd, made with flags, at buf (aligned to
+ * align) and again right after it.  quiet when failing is no surprise.
+ */
+static int
+ring_map(struct ring *r, unsigned int flags, size_t align, int quiet)
+{
+	char *base, *p;
+	size_t lead;
+	int fd;
+
+	if ((fd = memfd_create("jack_cat ring", MFD_CLOEXEC|flags)) == -1) {
+		if (!quiet)
+			fprintf(stderr, "memfd_create: %s\n", strerror(errno));
+		return (-1);
+	}
+	if (ftruncate(fd, r->size) == -1) {
+		if (!quiet)
+			fprintf(stderr, "ring ftruncate(%zu): %s\n", r->size,
+				strerror(errno));
+		close(fd);
+		return (-1);
+	}
+
+	/* claim room for both, aligned, then put the file in each half */
+	base = mmap(NULL, 2 * r->size + align, PROT_NONE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		if (!quiet)
+			fprintf(stderr, "ring mmap(%zu): %s\n", 2 * r->size,
+				strerror(errno));
+		close(fd);
+		return (-1);
+	}
+	p = (char *)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+	lead = p - base;
+	if (lead > 0)
+		munmap(base, lead);
+	munmap(p + 2 * r->size, align - lead);
+	if (mmap(p, r->size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+		fd, 0) == MAP_FAILED ||
+	    mmap(p + r->size, r->size, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED) {
+		if (!quiet)
+			fprintf(stderr, "ring mmap(%zu): %s\n", r->size,
+				strerror(errno));
+		munmap(p, 2 * r->size);
+		close(fd);
+		return (-1);
+	}
+	close(fd);			/* the mappings keep it */
+	r->buf = p;
+	return (0);
+}
+
+struct ring *
+ring_create(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t huge = ring_huge_size();
+	struct ring *r;
+
+	if (size == 0)
+		return (NULL);
+	if (posix_memalign((void **)&r, RING_LINE, sizeof(*r)) != 0)
+		return (NULL);
+	memset(r, 0, sizeof(*r));
+	r->page = page;
+
+	if (huge > page && size >= huge) {
+		r->size = (size + huge - 1) / huge * huge;
+#ifdef MFD_HUGETLB
+		if (ring_map(r, MFD_HUGETLB, huge, 1) == 0) {
+			r->page = huge;
+			r->huge = RING_HUGETLB;
+			return (r);
+		}
+#endif
+		if (ring_map(r, 0, huge, 0) == 0) {
+			if (madvise(r->buf, 2 * r->size, MADV_HUGEPAGE) == 0)
+				r->huge = RING_THP;
+			return (r);
+		}
+	} else {
+		r->size = (size + page - 1) / page * page;
+		if (ring_map(r, 0, page, 0) == 0)
+			return (r);
+	}
+	free(r);
+	return (NULL);
+}
+
+void
+ring_free(struct ring *r)
+{
+	munmap(r->buf, 2 * r->size);
+	free(r);
+}
+
+struct prefault {
+	pthread_t thread;
+	int started;
+	volatile char *p;
+	size_t len;
+	size_t page;
+};
+
+/* Write to each page of a part of the ring, which faults it in */
+static void *
+ring_touch(void *arg)
+{
+	struct prefault *pf = arg;
+	size_t off;
+
+	for (off = 0; off < pf->len; off += pf->page)
+		pf->p[off] = 0;
+	return (NULL);
+}
+
+/*
+ * Fault in every page of both mappings (the second just maps the pages of
+ * the first), spread over threads for a big ring.
+ */
+void
+ring_prefault(struct ring *r)
+{
+	struct prefault pf[RING_PREFAULT_MAX];
+	size_t len = 2 * r->size, per;
+	long n, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	n = len / RING_PREFAULT_MIN;
+	if (n > cpus)
+		n = cpus;
+	if (n > RING_PREFAULT_MAX)
+		n = RING_PREFAULT_MAX;
+	if (n < 1)
+		n = 1;
+	/* whole pages each; with big pages that can leave fewer parts */
+	per = (len / n + r->page - 1) / r->page * r->page;
+	n = (len + per - 1) / per;
+
+	for (i=0; i < n; i++) {
+		pf[i].p = r->buf + i * per;
+		pf[i].len = i == n - 1 ? len - i * per : per;
+		pf[i].page = r->page;
+		pf[i].started = i > 0 &&
+		    pthread_create(&pf[i].thread, NULL, ring_touch, &pf[i]) == 0;
+	}
+	/* this thread does the first part, and any that did not start */
+	for (i=0; i < n; i++) {
+		if (pf[i].started)
+			pthread_join(pf[i].thread, NULL);
+		else
+			ring_touch(&pf[i]);
+	}
+}
+
+/*
+ * Keep the ring's pages in memory; says why not and returns -1 if not.
+ * Only the first mapping is locked: the second maps the same pages, which
+ * cannot be paged out while the first has them locked, and RLIMIT_MEMLOCK
+ * would count them twice.
+ */
+int
+ring_lock(struct ring *r)
+{
+	if (mlock(r->buf, r->size) == -1) {
+		fprintf(stderr, "mlock of the ring buffer: %s (ulimit -l?)\n",
+			strerror(errno));
+		return (-1);
+	}
+	r->locked = 1;
+	return (0);
+}
+
+/* Move position p on by len, which is at most size */
+static inline size_t
+ring_add(struct ring *r, size_t p, size_t len)
+{
+	p += len;
+	return (p >= 2 * r->size ? p - 2 * r->size : p);
+}
+
+/* Bytes from tail t to head h */
+static inline size_t
+ring_between(struct ring *r, size_t t, size_t h)
+{
+	return (h >= t ? h - t : h + 2 * r->size - t);
+}
+
+/* Where position p is in the first mapping */
+static inline char *
+ring_at(struct ring *r, size_t p)
+{
+	return (r->buf + (p >= r->size ? p - r->size : p));
+}
+
+/*
+ * How much space is free, which starts at *p.  The consumer's tail is
+ * only loaded when the last one seen leaves less than want free.
+ */
+size_t
+ring_reserve(struct ring *r, size_t want, char **p)
+{
+	size_t space;
+
+	space = r->size - ring_between(r, r->tail_seen, r->head);
+	if (space < want) {
+		r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		space = r->size - ring_between(r, r->tail_seen, r->head);
+	}
+	*p = ring_at(r, r->head);
+	return (space);
+}
+
+/* len bytes of the reserved space have been filled */
+void
+ring_commit(struct ring *r, size_t len)
+{
+	__atomic_store_n(&r->head, ring_add(r, r->head, len),
+		__ATOMIC_RELEASE);
+}
+
+/* Copy in up to len bytes; returns how many there was room for */
+size_t
+ring_write(struct ring *r, const char *src, size_t len)
+{
+	size_t space;
+	char *p;
+
+	space = ring_reserve(r, len, &p);
+	if (len > space)
+		len = space;
+	memcpy(p, src, len);
+	ring_commit(r, len);
+	return (len);
+}
+
+/*
+ * How much data there is, which starts at *p.  The producer's head is only
+ * loaded when the last one seen leaves less than want to take.
+ */
+size_t
+ring_peek(struct ring *r, size_t want, char **p)
+{
+	size_t fill;
+
+	fill = ring_between(r, r->tail, r->head_seen);
+	if (fill < want) {
+		r->head_seen = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		fill = ring_between(r, r->tail, r->head_seen);
+	}
+	*p = ring_at(r, r->tail);
+	return (fill);
+}
+
+/* len bytes of the data have been used */
+void
+ring_consume(struct ring *r, size_t len)
+{
+	__atomic_store_n(&r->tail, ring_add(r, r->tail, len),
+		__ATOMIC_RELEASE);
+}
+
+/* Copy out up to len bytes; returns how many there were */
+size_t
+ring_read(struct ring *r, char *dst, size_t len)
+{
+	size_t fill;
+	char *p;
+
+	fill = ring_peek(r, len, &p);
+	if (len > fill)
+		len = fill;
+	memcpy(dst, p, len);
+	ring_consume(r, len);
+	return (len);
+}
+
+/* Bytes of data in the ring, as of now */
+size_t
+ring_fill(struct ring *r)
+{
+	size_t t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	return (ring_between(r, t, __atomic_load_n(&r->head,
+		__ATOMIC_ACQUIRE)));
+}
+
+/* Bytes of free space in the ring, as of now */
+size_t
+ring_space(struct ring *r)
+{
+	return (r->size - ring_fill(r));
+}
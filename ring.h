@@ -0,0 +1,70 @@
+/*
+ * ring - single producer, single consumer ring buffer of frames
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+/*
+ * Keep what the producer writes, what the consumer writes and what neither
+ * does on separate cache lines.  128 rather than 64 because the adjacent
+ * line prefetcher pulls lines in pairs.
+ */
+#define RING_LINE	128
+
+/*
+ * head and tail run from 0 to twice size, so a full ring and an empty one
+ * differ; a position's byte in buf is the position modulo size.  Each side
+ * keeps a snapshot of the other's index and only reads the other's cache
+ * line again when the snapshot says there is not enough.
+ *
+ * The memory is mapped twice, back to back, so the size bytes from any
+ * position are one contiguous span of buf.
+ */
+struct ring {
+	/* written by the producer */
+	size_t head __attribute__((aligned(RING_LINE)));
+	size_t tail_seen;	/* tail when the producer last looked */
+
+	/* written by the consumer */
+	size_t tail __attribute__((aligned(RING_LINE)));
+	size_t head_seen;	/* head when the consumer last looked */
+
+	/* never written once the ring is in use */
+	char *buf __attribute__((aligned(RING_LINE)));
+	size_t size;		/* bytes, a multiple of the page size */
+	size_t page;		/* bytes in a page of the mapping */
+	int huge;		/* RING_HUGETLB, RING_THP or 0 */
+	int locked;		/* ring_lock has mlocked it */
+};
+
+#define RING_HUGETLB	1	/* hugetlbfs pages */
+#define RING_THP	2	/* transparent huge pages asked for */
+
+struct ring *ring_create(size_t size);
+void ring_free(struct ring *r);
+void ring_prefault(struct ring *r);
+int ring_lock(struct ring *r);
+
+/* producer */
+size_t ring_reserve(struct ring *r, size_t want, char **p);
+void ring_commit(struct ring *r, size_t len);
+size_t ring_write(struct ring *r, const char *src, size_t len);
+
+/* consumer */
+size_t ring_peek(struct ring *r, size_t want, char **p);
+void ring_consume(struct ring *r, size_t len);
+size_t ring_read(struct ring *r, char *dst, size_t len);
+
+/* either side */
+size_t ring_fill(struct ring *r);
+size_t ring_space(struct ring *r);
+
+#endif /* RING_H */
@@ -0,0 +1,152 @@
+/*
+ * silence - find runs of quiet samples
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * The capture disk thread scans the ringbuffer for spans of silence, which
+ * it records in the file as a count of frames instead of writing them.
+ * The SIMD versions compare a vector of absolute values against the level
+ * and look at the comparison mask; the first vector that is not all one
+ * way ends the span.  Levels as in interleave.c; AVX-512 uses AVX2.
+ */
+
+#include "silence.h"
+#include "interleave.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD	1
+#endif
+
+static inline int
+quiet(float x, float level)
+{
+	return (x <= level && x >= -level);
+}
+
+static size_t
+quiet_scalar(const float *src, size_t n, float level)
+{
+	size_t i;
+
+	for (i=0; i < n && quiet(src[i], level); i++)
+		;
+	return (i);
+}
+
+static size_t
+loud_scalar(const float *src, size_t n, float level)
+{
+	size_t i;
+
+	for (i=0; i < n && !quiet(src[i], level); i++)
+		;
+	return (i);
+}
+
+#ifdef HAVE_X86_SIMD
+/* mask of the quiet samples of the 4 at src */
+static inline int
+quiet_sse2(const float *src, __m128 level)
+{
+	__m128 x = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_loadu_ps(src));
+
+	return (_mm_movemask_ps(_mm_cmple_ps(x, level)));
+}
+
+static size_t
+quiet_span_sse2(const float *src, size_t n, float level)
+{
+	__m128 l = _mm_set1_ps(level);
+	size_t i;
+	int m;
+
+	for (i=0; i + 4 <= n; i += 4) {
+		if ((m = quiet_sse2(src + i, l)) != 0xf)
+			return (i + __builtin_ctz(~m));
+	}
+	return (i + quiet_scalar(src + i, n - i, level));
+}
+
+static size_t
+loud_span_sse2(const float *src, size_t n, float level)
+{
+	__m128 l = _mm_set1_ps(level);
+	size_t i;
+	int m;
+
+	for (i=0; i + 4 <= n; i += 4) {
+		if ((m = quiet_sse2(src + i, l)) != 0)
+			return (i + __builtin_ctz(m));
+	}
+	return (i + loud_scalar(src + i, n - i, level));
+}
+
+#define AVX2	__attribute__((target("avx2")))
+
+static inline AVX2 int
+quiet_avx2(const float *src, __m256 level)
+{
+	__m256 x = _mm256_andnot_ps(_mm256_set1_ps(-0.0f),
+		_mm256_loadu_ps(src));
+
+	return (_mm256_movemask_ps(_mm256_cmp_ps(x, level, _CMP_LE_OQ)));
+}
+
+static AVX2 size_t
+quiet_span_avx2(const float *src, size_t n, float level)
+{
+	__m256 l = _mm256_set1_ps(level);
+	size_t i;
+	int m;
+
+	for (i=0; i + 8 <= n; i += 8) {
+		if ((m = quiet_avx2(src + i, l)) != 0xff)
+			return (i + __builtin_ctz(~m));
+	}
+	return (i + quiet_scalar(src + i, n - i, level));
+}
+
+static AVX2 size_t
+loud_span_avx2(const float *src, size_t n, float level)
+{
+	__m256 l = _mm256_set1_ps(level);
+	size_t i;
+	int m;
+
+	for (i=0; i + 8 <= n; i += 8) {
+		if ((m = quiet_avx2(src + i, l)) != 0)
+			return (i + __builtin_ctz(m));
+	}
+	return (i + loud_scalar(src + i, n - i, level));
+}
+#endif /* HAVE_X86_SIMD */
+
+static const struct silence_kernel kernels[IL_LEVELS] = {
+	{ "scalar", quiet_scalar, loud_scalar },
+#ifdef HAVE_X86_SIMD
+	{ "sse2", quiet_span_sse2, loud_span_sse2 },
+	{ "avx2", quiet_span_avx2, loud_span_avx2 },
+	{ "avx2", quiet_span_avx2, loud_span_avx2 },
+#endif
+};
+
+/* Kernels for a CPU level, which must not be above interleave_level() */
+const struct silence_kernel *
+silence_lookup(int level)
+{
+	while (level > IL_SCALAR && kernels[level].quiet == NULL)
+		level--;
+	return (&kernels[level]);
+}
+
+/* Best kernels for this CPU; interleave_init must have been run */
+const struct silence_kernel *
+silence_select(void)
+{
+	return (silence_lookup(interleave_level()));
+}
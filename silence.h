@@ -0,0 +1,30 @@
+/*
+ * silence - find runs of quiet samples
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef SILENCE_H
+#define SILENCE_H
+
+#include <stddef.h>
+
+/*
+ * Count the samples at the start of src, up to n, that are quiet (|x| <=
+ * level), or for the other function that are not.  NaN is not quiet.
+ */
+typedef size_t (*span_fn)(const float *src, size_t n, float level);
+
+struct silence_kernel {
+	const char *name;
+	span_fn quiet;
+	span_fn loud;
+};
+
+const struct silence_kernel *silence_lookup(int level);
+const struct silence_kernel *silence_select(void);
+
+#endif /* SILENCE_H */
@@ -0,0 +1,178 @@
+/*
+ * uring - minimal io_uring interface using the raw system calls
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * Just enough of io_uring for the disk threads: one ring, queue some reads
+ * or writes, submit them, and reap completions.  liburing would do, but this
+ * keeps jack_cat's only dependency jack.  All functions return a negative
+ * errno on failure, like the kernel does.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int
+sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, NULL, 0));
+}
+
+int
+uring_init(struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	if ((u->fd = sys_setup(entries, &p)) < 0)
+		return (-errno);
+	u->entries = p.sq_entries;
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size)
+			u->sq_size = u->cq_size;
+		u->cq_size = u->sq_size;
+	}
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) {
+			u->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto fail;
+	}
+
+	u->sq_head = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+	u->sqe_tail = *u->sq_tail;
+	return (0);
+
+fail:
+	err = -errno;
+	if (u->sq_ptr == MAP_FAILED)
+		u->sq_ptr = NULL;
+	uring_exit(u);
+	return (err);
+}
+
+void
+uring_exit(struct uring *u)
+{
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ptr != NULL && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_size);
+	if (u->sq_ptr != NULL)
+		munmap(u->sq_ptr, u->sq_size);
+	if (u->fd >= 0)
+		close(u->fd);
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+/* A cleared sqe to fill in, or NULL if the submission queue is full */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head;
+
+	head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (u->sqe_tail - head >= u->entries)
+		return (NULL);
+	sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+	u->sq_array[u->sqe_tail & *u->sq_mask] = u->sqe_tail & *u->sq_mask;
+	u->sqe_tail++;
+	u->pending++;
+	memset(sqe, 0, sizeof(*sqe));
+	return (sqe);
+}
+
+/*
+ * Hand queued sqes to the kernel, and wait for wait_nr completions.
+ * Returns the number submitted.
+ */
+int
+uring_submit(struct uring *u, unsigned wait_nr)
+{
+	int r;
+
+	__atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+	do {
+		r = sys_enter(u->fd, u->pending, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return (-errno);
+	u->pending -= r;
+	return (r);
+}
+
+/* The next completion, or NULL if there is none yet */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return (NULL);
+	return (&u->cqes[head & *u->cq_mask]);
+}
+
+/* Submit anything queued and wait for the next completion */
+int
+uring_wait_cqe(struct uring *u, struct io_uring_cqe **cqe)
+{
+	int r;
+
+	while ((*cqe = uring_peek_cqe(u)) == NULL) {
+		if ((r = uring_submit(u, 1)) < 0)
+			return (r);
+	}
+	return (0);
+}
+
+/* Done with the completion returned by uring_peek_cqe/uring_wait_cqe */
+void
+uring_cqe_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,40 @@
+/*
+ * uring - minimal io_uring interface using the raw system calls
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned entries;		/* submission queue size */
+	unsigned pending;		/* sqes queued but not submitted */
+	/* submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;		/* local copy of sq tail */
+	/* completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* mappings */
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+};
+
+int uring_init(struct uring *u, unsigned entries);
+void uring_exit(struct uring *u);
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+int uring_submit(struct uring *u, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *u);
+int uring_wait_cqe(struct uring *u, struct io_uring_cqe **cqe);
+void uring_cqe_seen(struct uring *u);
+
+#endif /* URING_H */
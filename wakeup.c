@@ -0,0 +1,64 @@
+/*
+ * wakeup - lock-free wakeup of a thread from the jack callback
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * The jack callback must not block, so it cannot take a mutex to signal a
+ * condition variable.  Instead the sleeper waits on a futex holding a
+ * sequence number that every post increments:
+ *
+ *	seq = wakeup_prepare(w);
+ *	if (nothing to do)
+ *		wakeup_wait(w, seq);
+ *
+ * A post that lands between wakeup_prepare and wakeup_wait changes seq, so
+ * the futex wait returns at once and the wakeup is not lost.  The poster
+ * only makes a system call when the sleeper has said it is waiting; the
+ * common case is one atomic add.  wakeup_post is also safe to call from a
+ * signal handler.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "wakeup.h"
+
+void
+wakeup_init(struct wakeup *w)
+{
+	w->seq = 0;
+	w->waiting = 0;
+}
+
+void
+wakeup_post(struct wakeup *w)
+{
+	__atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->waiting, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &w->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Snapshot the sequence before checking whether there is work to do */
+unsigned int
+wakeup_prepare(struct wakeup *w)
+{
+	return (__atomic_load_n(&w->seq, __ATOMIC_SEQ_CST));
+}
+
+/* Sleep until there has been a post since wakeup_prepare returned seq */
+void
+wakeup_wait(struct wakeup *w, unsigned int seq)
+{
+	__atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&w->seq, __ATOMIC_SEQ_CST) == seq) {
+		if (syscall(SYS_futex, &w->seq, FUTEX_WAIT_PRIVATE, seq,
+		    NULL, NULL, 0) == -1 && errno != EINTR && errno != EAGAIN)
+			break;
+	}
+	__atomic_store_n(&w->waiting, 0, __ATOMIC_SEQ_CST);
+}
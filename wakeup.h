@@ -0,0 +1,23 @@
+/*
+ * wakeup - lock-free wakeup of a thread from the jack callback
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef WAKEUP_H
+#define WAKEUP_H
+
+struct wakeup {
+	unsigned int seq;	/* bumped by every post */
+	int waiting;		/* a thread is (about to be) asleep */
+};
+
+void wakeup_init(struct wakeup *w);
+void wakeup_post(struct wakeup *w);
+unsigned int wakeup_prepare(struct wakeup *w);
+void wakeup_wait(struct wakeup *w, unsigned int seq);
+
+#endif /* WAKEUP_H */
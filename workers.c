@@ -0,0 +1,121 @@
+/*
+ * workers - a pool of threads running jobs for the disk thread
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ *
+ * The disk thread posts independent jobs (compressing or decompressing a
+ * chunk) and collects them in the order it posted them, so the jobs can
+ * finish in any order.  Only the disk thread and the workers use this, never
+ * the jack callback, so a mutex and condition variables are fine.  With no
+ * threads, workers_post runs the job there and then.
+ */
+
+#include <stdlib.h>
+#include "workers.h"
+
+static void *
+worker(void *arg)
+{
+	struct workers *w = (struct workers *)arg;
+	struct job *j;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->head == NULL && !w->stop)
+			pthread_cond_wait(&w->work, &w->lock);
+		if (w->head == NULL)
+			break;
+		j = w->head;
+		w->head = j->next;
+		if (w->head == NULL)
+			w->tail = NULL;
+		pthread_mutex_unlock(&w->lock);
+		j->run(j);
+		pthread_mutex_lock(&w->lock);
+		j->done = 1;
+		pthread_cond_broadcast(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return (NULL);
+}
+
+void
+workers_start(struct workers *w, int n)
+{
+	int i;
+
+	w->n = n;
+	w->head = w->tail = NULL;
+	w->stop = 0;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->done, NULL);
+	w->thread = calloc(n > 0 ? n : 1, sizeof(pthread_t));
+	for (i=0; i < n; i++)
+		pthread_create(&w->thread[i], NULL, worker, w);
+}
+
+void
+workers_post(struct workers *w, struct job *j)
+{
+	j->done = 0;
+	j->next = NULL;
+	if (w->n == 0) {
+		j->run(j);
+		j->done = 1;
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	if (w->tail != NULL)
+		w->tail->next = j;
+	else
+		w->head = j;
+	w->tail = j;
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Has j finished? */
+int
+workers_done(struct workers *w, struct job *j)
+{
+	int done;
+
+	if (w->n == 0)
+		return (j->done);
+	pthread_mutex_lock(&w->lock);
+	done = j->done;
+	pthread_mutex_unlock(&w->lock);
+	return (done);
+}
+
+/* Wait for j to finish */
+void
+workers_wait(struct workers *w, struct job *j)
+{
+	if (w->n == 0)
+		return;
+	pthread_mutex_lock(&w->lock);
+	while (!j->done)
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Finish the jobs queued, and stop the threads */
+void
+workers_stop(struct workers *w)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->work);
+	pthread_mutex_unlock(&w->lock);
+	for (i=0; i < w->n; i++)
+		pthread_join(w->thread[i], NULL);
+	free(w->thread);
+}
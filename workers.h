@@ -0,0 +1,38 @@
+/*
+ * workers - a pool of threads running jobs for the disk thread
+ *
+ * Copyright 2016 Glen Overby
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2, as published
+ * by the Free Software Foundation
+ */
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <pthread.h>
+
+/* Embed this at the start of the job's own structure */
+struct job {
+	void (*run)(struct job *j);
+	int done;
+	struct job *next;	/* queue of jobs not started */
+};
+
+struct workers {
+	pthread_t *thread;
+	int n;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* there are jobs queued, or stop */
+	pthread_cond_t done;	/* a job finished */
+	struct job *head, *tail;
+	int stop;
+};
+
+void workers_start(struct workers *w, int n);
+void workers_post(struct workers *w, struct job *j);
+int workers_done(struct workers *w, struct job *j);
+void workers_wait(struct workers *w, struct job *j);
+void workers_stop(struct workers *w);
+
+#endif /* WORKERS_H */